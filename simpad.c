@@ -4,6 +4,7 @@
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t on 32-bit systems too, for files over 2 GB
 
 #include <ctype.h>
 #include <stdio.h>
@@ -16,7 +17,35 @@
 #include <sys/ioctl.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+
+// File I/O is queued with io_uring where the kernel has it (talking to it directly, without liburing)
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define SIMPAD_IO_URING
+#endif
+#ifdef __NR_copy_file_range
+#define SIMPAD_COPY_RANGE
+#endif
+#define SIMPAD_INOTIFY // Changes to the open file (such as appends, in follow mode) are picked up with inotify
+#include <sys/inotify.h>
+#endif
+
+// The line scanner uses SSE2/AVX2 when the CPU has them, and is picked at runtime so one binary runs anywhere
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMPAD_X86_SIMD
+#include <immintrin.h>
+#endif
 
 /************ DEFINES ************/
 
@@ -25,6 +54,27 @@
 #define SIMPAD_VERSION "0.0.1"
 #define SIMPAD_TAB_STOP 8
 #define SIMPAD_QUIT_TIMES 1
+#define SIMPAD_MAX_THREADS 64 // Most threads used to load a file
+#define SIMPAD_LOAD_CHUNK (4 * 1024 * 1024) // Fewest bytes worth scanning for lines on a thread of their own
+#define SIMPAD_BUILD_CHUNK 65536 // Fewest rows worth building on a thread of their own
+#define SIMPAD_FIRST_PAINT (256 * 1024) // Bytes of a file laid out before the first screen is drawn, the rest loads behind it
+#define SIMPAD_LOAD_BLOCK (64 * 1024 * 1024) // Bytes the background loader scans before handing its lines over
+#define SIMPAD_STREAM_READ (1024 * 1024) // Bytes asked for by each read of a stream (simpad -)
+#define SIMPAD_IOV_BATCH 1024 // Pieces handed to each writev when saving (IOV_MAX on Linux)
+#define SIMPAD_SAVE_BUFFER (1024 * 1024) // Bytes gathered for each write when a file is rewritten in place
+#define SIMPAD_IO_DEPTH 8 // Reads or writes queued at once
+#define SIMPAD_READ_CHUNK (4 * 1024 * 1024) // Bytes asked for by each queued read
+#define SIMPAD_MAP_MIN (64 * 1024 * 1024) // Smaller files are read into memory rather than mapped, so nothing can pull them out from under the rows
+#define SIMPAD_COPY_MIN (64 * 1024) // Untouched stretches of a file at least this long are copied by the kernel on save
+#define SIMPAD_WINDOW_ROWS 65536 // Rows kept at most in windowed mode (more only while edited rows cannot be paged out)
+#define SIMPAD_WINDOW_PAGE 4096 // Rows paged in at a time in windowed mode
+#define SIMPAD_WINDOW_MARGIN 1024 // Rows kept in above and below the screen in windowed mode
+#define SIMPAD_HASH_BLOCK (16 * 1024) // Bytes in each block hashed to find what changed when a file is changed from outside
+#define SIMPAD_HASH_BATCH 64 // Blocks read at a time to be hashed
+#define SIMPAD_JOURNAL_BATCH (64 * 1024) // Bytes of records gathered before they are written to the journal anyway
+#define SIMPAD_JOURNAL_DELAY 1000 // Milliseconds a record waits at most to be written while typing goes on
+#define SIMPAD_CHECKPOINT_LINES 1024 // Lines between the entries of windowed mode's line index
+#define SIMPAD_HIGHLIGHT_LOOKBACK 1000 // How many unrendered rows above a row get rendered first, to find out if it starts inside a multiline comment
 
 // Replace each instance of the wasd characters with a constant representing the arrow keys
 // Add detection for special keypresses that utilize escape sequences
@@ -53,9 +103,30 @@ enum editorHighlight {
     HIGHLIGHT_MATCH
 };
 
+// How hard a save works to survive a crash or power cut (set with SIMPAD_DURABILITY=none|data|full)
+enum saveDurability {
+    DURABILITY_NONE = 0, // Rename the new file into place without syncing anything (still atomic if simpad dies)
+    DURABILITY_DATA,     // Sync the new file before the rename, so the old or new contents survive a power cut
+    DURABILITY_FULL      // Also sync the directory after the rename, so the save itself is not lost either
+};
+
+// The kinds of record in the crash-recovery journal, one for each way a row can be edited
+enum journalRecord {
+    JOURNAL_INSERT_CHARACTER = 1,
+    JOURNAL_DELETE_CHARACTER,
+    JOURNAL_INSERT_ROW,
+    JOURNAL_DELETE_ROW,
+    JOURNAL_APPEND_STRING,
+    JOURNAL_TRUNCATE_ROW
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0) // Highlight for numbers flag
 #define HL_HIGHLIGHT_STRINGS (1<<1) // Highlight for text flag
 
+#define ROW_RENDER_OWNED (1<<0) // The row's render is its own copy (it has tabs to expand) rather than its chars
+#define ROW_PAYLOAD_INLINE (1<<1) // The row's highlight (and owned render) live in inlinePayload rather than the arena
+#define ROW_RETIRED (1<<2) // The node was replaced by a copy in the live tree, which its previous pointer leads to
+
 /************ DATA ************/
 
 struct editorSyntax {
@@ -68,31 +139,384 @@ struct editorSyntax {
     int flags; // Determines whether we will highlight numbers / strings / comments for that filetype
 };
 
+// Bytes of highlight (and render, for a row that owns one) kept inside the row itself. It is sized so that a
+// whole row tree node fills exactly two 64-byte cache lines on 64-bit builds
+#define ROW_INLINE_SIZE 26
+
 typedef struct editorRow {
-    int index;
-    int size;
-    int renderSize;
-    char *chars;
-    char *render; // We can now control how to render tabs
+    int64_t size;
+    int64_t renderSize;
+    const char *chars; // A piece: points into the original buffer or the add buffer, never owned by the row and not NUL-terminated
+    const char *render; // We can now control how to render tabs (shares chars when the row has no tabs, so it is not always NUL-terminated)
     unsigned char *highlight;
-    int highlightOpenComment; // Boolean that tells us if there is an unclosed ml comment on the line
+    unsigned char highlightOpenComment; // Boolean that tells us if there is an unclosed ml comment on the line
+    unsigned char flags;
+    unsigned char inlinePayload[ROW_INLINE_SIZE]; // Holds the highlight of short rows, so they need no allocation at all
+    uint32_t version; // Version of the row tree the node holding the row was made in (see rowNodeFrozen)
 } editorRow;
 
+// Rows live in a randomized balanced tree ordered by line number. Each node knows how many rows are in its
+// subtree, so finding a row or inserting / removing one never has to touch the rows that come after it.
+// The nodes are also linked in file order, so walking to the row above or below never searches the tree.
+// A snapshot shares the tree as it was: it only ever reads left, right, count, bytes and the row's chars and
+// size, so those are copied on write, while the parent and in-order links belong to the live tree alone
+typedef struct rowNode {
+    editorRow row; // Must stay the first member, so an editorRow pointer is also a pointer to its node
+    struct rowNode *left;
+    struct rowNode *right;
+    struct rowNode *parent;
+    struct rowNode *previous;
+    struct rowNode *next;
+    int64_t count; // Number of rows in this subtree
+    size_t bytes; // Bytes in this subtree as they would be saved (every row plus its newline)
+} rowNode;
+
+// A line of text by reference: where its characters are and how many there are
+struct rowPiece {
+    const char *chars;
+    int64_t size;
+};
+
+// Row nodes come from chunks of exactly sized slots. A new chunk is at least as big as all the earlier ones
+// together, so the row capacity doubles and loading n rows takes O(log n) allocations
+struct rowChunk {
+    struct rowChunk *next;
+    size_t capacity;
+    size_t used;
+    rowNode *nodes; // Cache-line aligned, so no node straddles more lines than it has to
+};
+
+// The add buffer is a chain of blocks that are only ever appended to, so a piece pointing into it stays valid
+struct addBlock {
+    struct addBlock *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+};
+
+// Everything a piece can point into. The editor and any snapshots each hold a reference, and the last one
+// to let go frees it, so a snapshot stays readable after the file it came from is closed
+struct pieceStore {
+    int references;
+    char *orig; // Original buffer: the file exactly as it was read, rows point into it instead of copying lines out
+    size_t origSize;
+    int mapped; // Whether orig is the file mapped into memory, rather than a copy of it on the heap
+    struct stat origStat; // The file orig came from, as it was when it was loaded
+    struct addBlock *add; // Add buffer: newest block first, holds every byte typed since the file was opened
+};
+
+// A consistent, read-only version of the buffer for background readers (such as saving). It shares the row tree
+// as it was when the snapshot was taken, so taking one costs the same however many rows there are: the editor
+// copies a node before changing it for as long as the snapshot is held. The characters are shared as well, since
+// nothing in the original or add buffer is ever overwritten. In windowed mode it holds a list of pieces instead,
+// and a piece can hold many lines (each with its newline but the last)
+struct bufferSnapshot {
+    int references;
+    struct pieceStore *store;
+    struct rowPiece *rows; // The pieces, in windowed mode (NULL when the snapshot shares the row tree)
+    rowNode *root; // The row tree as it was when the snapshot was taken
+    int sharesTree;
+    int64_t numRows;
+    size_t bytes; // Size of the buffer as saved
+};
+
+// Row payloads (tree nodes, render and highlight buffers) are carved out of large slabs in power-of-two size
+// classes, so loading a file costs a handful of mallocs instead of several per line
+#define ARENA_SLAB_SIZE (256 * 1024)
+#define ARENA_MIN_SHIFT 4 // The smallest size class is 16 bytes...
+#define ARENA_CLASSES 9   // ...and the largest is 4096 bytes
+
+struct arenaSlab {
+    struct arenaSlab *next;
+    size_t used;
+    char data[];
+};
+
+// A freed block holds the link to the next free block of its size class
+struct arenaFreeBlock {
+    struct arenaFreeBlock *next;
+};
+
+// Blocks too big for a size class come straight from malloc, but stay linked so they can be freed with the arena
+struct arenaLarge {
+    struct arenaLarge *previous;
+    struct arenaLarge *next;
+};
+
+struct arenaStats {
+    unsigned long rowChunks;   // Row node chunks obtained from malloc
+    unsigned long allocations; // Blocks handed out by the arena
+    unsigned long reuses;      // ...of which came off a free list
+    unsigned long slabs;       // Slabs obtained from malloc
+    unsigned long large;       // Blocks too big for a size class, obtained from malloc
+    size_t bytesInUse;
+};
+
+// Syscalls made by the file I/O layer (set SIMPAD_STATS to print them), counted atomically since saves run on a
+// thread of their own
+struct ioStats {
+    unsigned long reads;   // pread
+    unsigned long writes;  // pwritev
+    unsigned long copies;  // copy_file_range
+    unsigned long enters;  // io_uring_enter, each of which queues or waits for any number of reads or writes
+};
+
+struct rowArena {
+    struct arenaSlab *slabs; // Newest slab first, blocks are bumped off the front one
+    struct arenaFreeBlock *freeLists[ARENA_CLASSES];
+    struct arenaLarge *large;
+    struct arenaStats stats;
+};
+
+// The row being typed into is held in a gap buffer: the text before and after the cursor sit at either end
+// of one allocation, so consecutive keystrokes only fill in the gap instead of moving the rest of the line
+struct gapBuffer {
+    editorRow *row; // Row currently held in the gap buffer (its chars are stale until flushed), or NULL
+    char *buffer;
+    size_t capacity;
+    size_t gapStart;
+    size_t gapEnd;
+};
+
+// The lines found in a buffer, as pieces pointing into it
+struct lineIndex {
+    struct rowPiece *lines;
+    int64_t numLines;
+    int64_t capacity;
+    const char *lineStart; // Where the line being scanned began
+};
+
+// A file still being split into lines by a background thread. The thread only scans, and the main thread (which
+// owns the row tree) moves the lines it has found into the buffer whenever it is waiting for a key
+struct fileLoader {
+    int active; // Some of the file is not in the buffer yet
+    int running; // The thread has not been joined yet
+    int cancel; // Set (under the lock) to make the thread stop early
+    pthread_t thread;
+    pthread_mutex_t lock;
+    const char *buffer;
+    size_t length;
+    size_t scanned; // Bytes scanned so far, under the lock
+    struct lineIndex ready; // Lines scanned but not in the buffer yet, under the lock
+    int percent; // The progress last shown in the status bar
+};
+
+// Text coming in on stdin (simpad -), read by a thread of its own. Each run of whole lines the thread reads is
+// copied into an add buffer block of its own and handed over with its lines, and the main thread puts them at the
+// end of the buffer whenever it is waiting for a key. The thread never touches a block again once it is handed over
+struct streamReader {
+    int active; // The stream has not been read to the end yet
+    int running; // The thread has not been joined yet
+    int cancel; // Set (under the lock) to make the thread stop early
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int fd;
+    struct addBlock *blocks; // Blocks handed over but not in the store yet, under the lock
+    struct lineIndex ready; // Their lines, under the lock
+    size_t bytes; // Bytes read so far, under the lock
+    int done; // The thread has finished, under the lock
+    int error; // Why it finished early, or 0
+};
+
+// How a save is going to be written
+struct savePlan {
+    int incremental; // Write only from byte from on, over the file as it is
+    int backward; // Write that tail back to front
+    size_t from;
+    int64_t line; // The row byte from falls in, and where in the row
+    size_t column;
+};
+
+// A save running on its own thread. It only reads its snapshot, so editing carries on while it writes, and the
+// main thread wraps it up when it is waiting for a key
+struct backgroundSave {
+    int active;
+    int done; // Set by the thread when it has finished (stored and loaded atomically)
+    pthread_t thread;
+    struct bufferSnapshot *snapshot;
+    char *path;
+    struct savePlan plan;
+    mode_t umask; // The process's umask, for the permissions of a new file
+    size_t written; // Bytes written so far, updated atomically
+    size_t dirtyFrom; // What was unsaved when the save began, in case it fails
+    int fd; // The file written, or -1
+    int error;
+    unsigned long windowGeneration; // Where the window was when the save began
+    off_t journalMark; // Bytes of the journal written before the save began
+};
+
+// Follow mode (simpad -f): the file is watched with inotify, and whatever is appended to it is read in as new rows
+struct fileFollower {
+    int enabled; // Follow whichever file is opened
+    int active; // Watching the file now
+    int inotify;
+    int fd; // The file being followed, kept open so appends to it can be read even after it is moved away
+    size_t offset; // Bytes of the file already in the buffer
+    int partial; // The last of them did not end a line, so the next bytes continue the last row
+    int pinned; // The cursor was put on the last row by follow mode...
+    int64_t pinnedRow; // ...and this is where
+};
+
+// Hashes of the blocks of a file as it was loaded (or saved). When it is changed from outside, hashing the new
+// version tells which blocks at either end are still the same, even if the file was rewritten in place (which the
+// mapping of the old version then shows too)
+struct blockHashes {
+    int running; // The thread has not been joined yet
+    int cancel; // Set (under the lock) to make the thread stop early
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct pieceStore *store; // The store whose file was hashed (NULL when not in use)
+    int fd; // The file, read by the thread
+    uint64_t *forward; // forward[k] is the hash of the k-th whole block from the start of the file...
+    uint64_t *backward; // ...and backward[k] of the k-th whole block back from its end
+    size_t blocks;
+    int valid; // Every block was hashed while the file was still as loaded, once the thread has been joined
+};
+
+// Watching the open file for changes made to it from outside
+struct fileWatch {
+    int inotify; // -1 when not watching
+    char *name; // The file's name in the directory watched
+    struct stat known; // The file as simpad last read or wrote it
+    int pending; // Something was done to it that has not been looked into yet
+    int changed; // It was changed while the buffer had edits, so saving would overwrite that change
+    int overwrite; // The user was warned about that, and saving again goes ahead
+    struct blockHashes hashes;
+};
+
+// The crash-recovery journal. Every edit is added to a batch as a record giving the byte offset it was made at, and
+// batches are written (and synced) together, once typing pauses or a batch has waited long enough. After a crash,
+// simpad -r replays the journal over the file it was started for
+struct editorJournal {
+    int active;
+    int recover; // Replay the journal of the next file opened (simpad -r)
+    int fd;
+    char *file; // The file the records are edits of
+    char *path; // The journal itself, next to it
+    off_t length; // Bytes written to the journal so far
+    char *batch; // Records not written yet
+    size_t used;
+    size_t capacity;
+    struct timespec since; // When the first of them was added
+    int writing; // A batch has been handed to a thread that writes and syncs it, which has not been joined yet
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int written; // The thread is done with the batch, under the lock
+    int error; // Why writing it failed, or 0, under the lock
+    char *flushing; // The batch being written (it and batch swap buffers when one is handed over)
+    size_t flushingUsed;
+    size_t flushingCapacity;
+};
+
+// What the journal starts with: the file as it was when the journal was started, so records are only ever
+// replayed over that same version of it
+struct journalHeader {
+    char magic[8];
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t modified;
+    int64_t modifiedNanoseconds;
+};
+
+// Each batch of records is written after its length and a hash of it, so a batch only half written by a crash is
+// told apart and left out
+struct journalBatch {
+    uint32_t length;
+    uint32_t hash;
+};
+
+// A stretch of the file that was edited and then paged out in windowed mode: the original bytes from start to end
+// are replaced by the lines in text, each ending in a newline
+struct windowPatch {
+    size_t start;
+    size_t end;
+    const char *text; // In the add buffer
+    size_t length;
+    int64_t lines;
+    int64_t origLines; // Lines of the original buffer from start to end
+};
+
+// Where every SIMPAD_CHECKPOINT_LINES-th line of the original buffer starts, found by a thread of its own. Any line
+// number is then a short count away from the checkpoint before it
+struct lineCheckpoints {
+    int active; // Between editorCheckpointStart and editorCheckpointStop (only the main thread touches it)
+    int running; // The thread has not been joined yet
+    int cancel;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    const char *buffer;
+    size_t length;
+    size_t *offsets; // offsets[k] is where line k * SIMPAD_CHECKPOINT_LINES starts, under the lock (the thread moves it as it grows)
+    int64_t count;
+    int64_t capacity;
+    size_t scanned; // Bytes gone through so far, under the lock
+    int64_t lines; // Newlines found in them, under the lock
+};
+
+// Windowed mode, for files too big to have a row for every line. Only the rows for the original bytes from start
+// to end are in the tree, and they are paged in and out as the screen moves. Edits that are paged out are kept as
+// patches, which a save merges with the original file. Row numbers (such as the cursor's) count from the window
+struct fileWindow {
+    int active;
+    size_t start;
+    size_t end;
+    int64_t origLines; // Lines of the original buffer from start to end
+    struct windowPatch *patches; // In file order, none of them inside the window
+    int64_t numPatches;
+    int64_t patchCapacity;
+    int64_t split; // How many patches come before the window
+    int64_t shift; // Rows paged in above the window less rows paged out from its top, to carry row numbers across
+    int64_t jumps; // Times the window has moved somewhere else entirely, which row numbers do not survive
+    unsigned long generation; // Changes whenever the window pages
+    struct lineCheckpoints checkpoints;
+};
+
+// A run of the file outside the window: original bytes, or a patch's lines
+struct windowPart {
+    const char *text;
+    size_t length;
+};
+
 struct editorConfig {
-    int cursorX, cursorY;
-    int renderX; // Horizontal coordinate variable (some characters do not only occupy one column space)
-    int rowOffset; 
-    int colOffset;
+    int64_t cursorX, cursorY;
+    int64_t renderX; // Horizontal coordinate variable (some characters do not only occupy one column space)
+    int64_t rowOffset; 
+    int64_t colOffset;
     int termRows;
     int termCols;
-    int numRows;
-    editorRow *row;
-    int changed;
+    int64_t numRows;
+    rowNode *rows; // Root of the row tree
+    struct rowChunk *rowChunks; // Newest chunk first, nodes are taken off the front one
+    rowNode *freeRows; // Nodes of deleted rows, linked through their next pointers
+    rowNode *retiredRows; // Nodes taken out of the tree while a snapshot still reads them, linked the same way
+    uint32_t treeVersion; // Bumped by every snapshot of the tree, so nodes made before it are known to be shared
+    int sharedSnapshots; // Snapshots that share the tree (nodes are only copied on write while there are any)
+    size_t rowCapacity; // Number of node slots in all chunks
+    struct pieceStore *store;
+    volatile sig_atomic_t mapFaults; // Pages of a mapped file that had been cut off on disk, and were filled with zeros
+    sig_atomic_t mapFaultsSeen; // How many of those the user has been told about
+    size_t pageSize;
+    struct gapBuffer gap;
+    struct rowArena arena;
+    struct ioStats io;
+    struct fileLoader loader;
+    struct streamReader stream;
+    struct fileFollower follow;
+    struct fileWatch watch;
+    struct editorJournal journal;
+    struct backgroundSave save;
+    struct fileWindow window;
+    enum saveDurability durability;
+    mode_t umask; // Read once at startup, since the only way to read it is to set it, for every thread at once
+    size_t dirtyFrom; // The first byte that may differ from the file on disk (SIZE_MAX when nothing does)
+    unsigned long rowsGeneration; // Changes whenever the rows are replaced from the file, so row numbers from before it mean nothing
     char *fileName;
     char statusMsg[80];
     time_t statusMsg_time;
     struct editorSyntax *syntax;
     struct termios orig_termios;
+    pthread_t mainThread; // The thread the editor runs on, which everything not handed to a thread of its own stays on
 };
 
 // Declare E of type editorConfig
@@ -127,6 +551,14 @@ struct editorSyntax highlightDB[] = {
 // This prototype allows us to call editorSetStatus before it is defined later in the file (due to C's single-pass compilation method)
 void editorSetStatusMessage(const char *formatString, ...);
 void editorRefreshScreen();
+int editorPoll();
+void editorSaveFinish();
+void editorOpen(char *fileName);
+size_t editorCursorOffset();
+void editorJournalRecord(int type, editorRow *row, size_t column, const char *s, size_t length);
+void editorJournalFlush();
+void editorJournalJoin();
+void editorJournalCreate(const char *file, const struct stat *fileStat, const char *tail, size_t length);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 /************ TERMINAL ************/
@@ -134,6 +566,14 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int));
     This void function is responsible for exiting the program with an error
 */
 void die(const char *s) {
+    // Whatever edits are still waiting to go to the journal are written first, so they can be recovered. Only the
+    // main thread touches the journal, so a thread in the background dying leaves them where they are
+    int error = errno;
+    if (pthread_equal(pthread_self(), E.mainThread)) {
+        editorJournalFlush();
+    }
+    errno = error;
+
     // Reposition cursor at the top left corner 
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
@@ -185,6 +625,10 @@ int editorReadKey() {
         if (nread == -1 && errno != EAGAIN) {
             die("read");
         }
+        // No key yet, so catch up with anything happening in the background (and redraw if it shows)
+        if (editorPoll()) {
+            editorRefreshScreen();
+        }
     }
     
     if (c == '\x1b') {
@@ -289,144 +733,1186 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-/************ SYNTAX HIGHLIGHTING ************/
+/************ ROW ARENA ************/
 
-// A function that takes a character and returns true if it is considered a separator character
-int isSeparator(int c){
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int arenaSizeClass(size_t size) {
+    int sizeClass = 0;
+    while (((size_t)1 << (sizeClass + ARENA_MIN_SHIFT)) < size) {
+        sizeClass++;
+    }
+    return sizeClass;
 }
 
-void editorUpdateSyntax(editorRow *row){
-    row->highlight = realloc(row->highlight, row->renderSize);
-    memset(row->highlight, HIGHLIGHT_NORMAL, row->renderSize); // Set all characters in the row array to the default highlight value
+void *arenaAlloc(size_t size) {
+    struct rowArena *arena = &E.arena;
+    arena->stats.allocations++;
+    arena->stats.bytesInUse += size;
 
-    if (E.syntax == NULL) return; // Do nothing 
+    if (size > ((size_t)1 << (ARENA_CLASSES - 1 + ARENA_MIN_SHIFT))) {
+        struct arenaLarge *large = malloc(sizeof(struct arenaLarge) + size);
+        if (large == NULL) {
+            die("malloc");
+        }
+        large->previous = NULL;
+        large->next = arena->large;
+        if (arena->large) arena->large->previous = large;
+        arena->large = large;
+        arena->stats.large++;
+        return large + 1;
+    }
 
-    char **keywords = E.syntax->keywords;
+    int sizeClass = arenaSizeClass(size);
+    if (arena->freeLists[sizeClass]) {
+        struct arenaFreeBlock *block = arena->freeLists[sizeClass];
+        arena->freeLists[sizeClass] = block->next;
+        arena->stats.reuses++;
+        return block;
+    }
 
-    // Aliases for singleline, multiline start, and multiline end comment chars
-    char *scs = E.syntax->singleLineCmtStart;
-    char *mcs = E.syntax->multilineCommentStart;
-    char *mce = E.syntax->multilineCommentEnd;
+    size_t blockSize = (size_t)1 << (sizeClass + ARENA_MIN_SHIFT);
+    if (arena->slabs == NULL || ARENA_SLAB_SIZE - arena->slabs->used < blockSize) {
+        struct arenaSlab *slab = malloc(sizeof(struct arenaSlab) + ARENA_SLAB_SIZE);
+        if (slab == NULL) {
+            die("malloc");
+        }
+        slab->next = arena->slabs;
+        slab->used = 0;
+        arena->slabs = slab;
+        arena->stats.slabs++;
+    }
+    void *block = &arena->slabs->data[arena->slabs->used];
+    arena->slabs->used += blockSize;
+    return block;
+}
 
-    int scsLen = scs ? strlen(scs) : 0;
-    int mcsLen = mcs ? strlen(mcs) : 0;
-    int mceLen = mce ? strlen(mce) : 0;
+// Return a block to its size class; size must be the size it was allocated with
+void arenaFree(void *pointer, size_t size) {
+    struct rowArena *arena = &E.arena;
+    if (pointer == NULL) return;
+    arena->stats.bytesInUse -= size;
+
+    if (size > ((size_t)1 << (ARENA_CLASSES - 1 + ARENA_MIN_SHIFT))) {
+        struct arenaLarge *large = (struct arenaLarge *)pointer - 1;
+        if (large->previous) large->previous->next = large->next;
+        else arena->large = large->next;
+        if (large->next) large->next->previous = large->previous;
+        free(large);
+        return;
+    }
 
-    int previousSeparator = 1; // Beginning of a line is considered a separator, defaulted to true
-    int inString = 0; // Tells us if we are in a string or not (until we hit a closing quote)
-    int inComment = (row->index > 0 && E.row[row->index - 1].highlightOpenComment); // Keep track of if we are in a comment (only for multiline)
+    int sizeClass = arenaSizeClass(size);
+    struct arenaFreeBlock *block = pointer;
+    block->next = arena->freeLists[sizeClass];
+    arena->freeLists[sizeClass] = block;
+}
 
-    int i = 0;
-    while (i < row->renderSize){
-        char c = row->render[i];
-        unsigned char previousHighlight = (i > 0) ? row->highlight[i - 1] : HIGHLIGHT_NORMAL;
+// Release every block at once, without visiting the rows that were using them
+void arenaReset() {
+    struct rowArena *arena = &E.arena;
 
-        // Ensure we are not in a string / comment and that there is some length to the comment
-        if (scsLen && !inString && !inComment) {
-            // Check if the character is the start of a single line comment
-            if (!strncmp(&row->render[i], scs, scsLen)) {
-                memset(&row->highlight[i], HIGHLIGHT_COMMENT, row->renderSize - i);
-                break;
-            }
+    while (arena->slabs) {
+        struct arenaSlab *next = arena->slabs->next;
+        free(arena->slabs);
+        arena->slabs = next;
+    }
+    while (arena->large) {
+        struct arenaLarge *next = arena->large->next;
+        free(arena->large);
+        arena->large = next;
+    }
+    memset(arena->freeLists, 0, sizeof(arena->freeLists));
+    arena->stats.bytesInUse = 0;
+}
+
+// Make sure n more row nodes can be handed out without another allocation
+void editorReserveRows(size_t n) {
+    size_t available = E.rowChunks ? E.rowChunks->capacity - E.rowChunks->used : 0;
+    if (available >= n) return;
+
+    size_t capacity = E.rowCapacity > 64 ? E.rowCapacity : 64;
+    if (capacity < n) capacity = n;
+    struct rowChunk *chunk = malloc(sizeof(struct rowChunk));
+    void *nodes;
+    if (chunk == NULL || posix_memalign(&nodes, 64, capacity * sizeof(rowNode)) != 0) {
+        die("malloc");
+    }
+    chunk->nodes = nodes;
+    chunk->next = E.rowChunks;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    E.rowChunks = chunk;
+    E.rowCapacity += capacity;
+    E.arena.stats.rowChunks++;
+}
+
+rowNode *rowNodeAlloc() {
+    if (E.freeRows) {
+        rowNode *node = E.freeRows;
+        E.freeRows = node->next;
+        return node;
+    }
+    editorReserveRows(1);
+    return &E.rowChunks->nodes[E.rowChunks->used++];
+}
+
+// Allocate n nodes next to each other, so a block of rows can be built by index (and by several threads at once)
+rowNode *rowNodeAllocBlock(size_t n) {
+    if (n == 1) return rowNodeAlloc();
+
+    editorReserveRows(n);
+    rowNode *nodes = &E.rowChunks->nodes[E.rowChunks->used];
+    E.rowChunks->used += n;
+    return nodes;
+}
+
+// Whether a node is shared with a snapshot, so the live tree has to copy it before changing it
+int rowNodeFrozen(rowNode *node) {
+    return E.sharedSnapshots > 0 && node->row.version != E.treeVersion;
+}
+
+// A node a snapshot may still be reading is only reused once no snapshot shares the tree
+void rowNodeFree(rowNode *node) {
+    rowNode **list = rowNodeFrozen(node) ? &E.retiredRows : &E.freeRows;
+    node->next = *list;
+    *list = node;
+}
+
+void rowNodesReclaim() {
+    while (E.retiredRows) {
+        rowNode *next = E.retiredRows->next;
+        rowNodeFree(E.retiredRows);
+        E.retiredRows = next;
+    }
+}
+
+// Copy a node shared with a snapshot, for the live tree to change instead. The copy takes the node's place in the
+// in-order links and as its children's parent, and takes over its payload. The node is left as it was for the
+// snapshot, and leads on to the copy, in case a row pointer taken before the copy is still in use
+rowNode *rowNodeCopy(rowNode *node) {
+    rowNode *copy = rowNodeAlloc();
+    *copy = *node;
+    copy->row.version = E.treeVersion;
+    if (node->row.flags & ROW_PAYLOAD_INLINE) {
+        copy->row.highlight = copy->row.inlinePayload;
+        if (node->row.flags & ROW_RENDER_OWNED) copy->row.render = (const char *)&copy->row.highlight[node->row.renderSize];
+    }
+    if (copy->left) copy->left->parent = copy;
+    if (copy->right) copy->right->parent = copy;
+    if (copy->previous) copy->previous->next = copy;
+    if (copy->next) copy->next->previous = copy;
+    if (E.gap.row == &node->row) E.gap.row = &copy->row;
+
+    node->row.render = NULL;
+    node->row.highlight = NULL;
+    node->row.flags = ROW_RETIRED;
+    node->previous = copy;
+    node->next = E.retiredRows;
+    E.retiredRows = node;
+    return copy;
+}
+
+// The node that can be changed in place of this one: a copy of it if it is shared with a snapshot
+rowNode *rowNodeOwn(rowNode *node) {
+    return rowNodeFrozen(node) ? rowNodeCopy(node) : node;
+}
+
+// Follow a node that has been copied on to the copy that is in the tree now
+rowNode *rowNodeLive(rowNode *node) {
+    while (node->row.flags & ROW_RETIRED) node = node->previous;
+    return node;
+}
+
+void rowChunksReset() {
+    while (E.rowChunks) {
+        struct rowChunk *next = E.rowChunks->next;
+        free(E.rowChunks->nodes);
+        free(E.rowChunks);
+        E.rowChunks = next;
+    }
+    E.freeRows = NULL;
+    E.retiredRows = NULL;
+    E.rowCapacity = 0;
+}
+
+/************ I/O BACKENDS ************/
+
+// Saving, and reading in a file that cannot be mapped, go through this layer. With io_uring, up to SIMPAD_IO_DEPTH
+// large reads or writes are queued in the kernel at once, so it works on them while simpad gets the next ones
+// ready. Without it (not Linux, not allowed, or SIMPAD_IO=sync) each one is a plain pread or pwritev
+
+#ifdef SIMPAD_IO_URING
+struct ioRing {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+};
+
+void ioRingTeardown(struct ioRing *ring) {
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != MAP_FAILED) munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != MAP_FAILED) munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Set up a ring and map its queues. Returns -1 when io_uring cannot (or should not) be used
+int ioRingSetup(struct ioRing *ring, unsigned entries) {
+    const char *mode = getenv("SIMPAD_IO");
+    if (mode && !strcmp(mode, "sync")) return -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ioRingTeardown(ring);
+        return -1;
+    }
+
+    char *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Queue one request and hand it to the kernel (callers never have more in flight than the ring holds)
+void ioRingSubmit(struct ioRing *ring, const struct io_uring_sqe *request) {
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    ring->sqes[index] = *request;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    do {
+        __sync_add_and_fetch(&E.io.enters, 1);
+    } while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == -1 && errno == EINTR);
+}
+
+// Take a completion off the ring, waiting for one if asked to. Returns whether there was one
+int ioRingComplete(struct ioRing *ring, struct io_uring_cqe *completion, int wait) {
+    while (1) {
+        unsigned head = *ring->cqHead;
+        if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            *completion = ring->cqes[head & *ring->cqMask];
+            __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            return 1;
         }
-        // Ensure the strings are of length > 0, and ensure we are not in a string
-        if (mcsLen && mceLen && !inString) {
-            if (inComment) {
-                // Begin highlighting the comment if inside a comment
-                row->highlight[i] = HIGHLIGHT_MULTILINE_COMMENT;
-                if (!strncmp(&row->render[i], mce, mceLen)){
-                    memset(&row->highlight[i], HIGHLIGHT_MULTILINE_COMMENT, mceLen);
-                    i += mceLen;
-                    inComment = 0;
-                    previousSeparator = 1;
-                    continue;
-                }
-                else {
-                    i++;
-                    continue;
-                }
-            }
-            // If we are not in a ml comment, we check if we are at the beginning
-            else if (!strncmp(&row->render[i], mcs, mceLen)) {
-                memset(&row->highlight[i], HIGHLIGHT_MULTILINE_COMMENT, mcsLen);
-                i += mcsLen;
-                inComment = 1;
-                continue;
-            }
+        if (!wait) return 0;
+        __sync_add_and_fetch(&E.io.enters, 1);
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) {
+            return 0;
         }
+    }
+}
+#endif
+
+// Read up to size bytes from offset with plain syscalls, stopping early only at the end of the file
+ssize_t ioReadSync(int fd, char *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        __sync_add_and_fetch(&E.io.reads, 1);
+        ssize_t bytesRead = pread(fd, &buffer[done], size - done, offset + done);
+        if (bytesRead == -1 && errno == EINTR) continue;
+        if (bytesRead == -1) return -1;
+        if (bytesRead == 0) break;
+        done += bytesRead;
+    }
+    return done;
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (inString) {
-                row->highlight[i] = HIGHLIGHT_STRING;
-                // Exempt escaped quotes, which don't close the string
-                if (c == '\\' && i + 1 < row->renderSize) {
-                    row->highlight[i + 1] = HIGHLIGHT_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == inString) {
-                    inString = 0;
+// Read a whole file of (up to) size bytes into buffer. Returns the number of bytes read, or -1
+ssize_t ioReadAll(int fd, char *buffer, size_t size) {
+#ifdef SIMPAD_IO_URING
+    struct ioRing ring;
+    if (size > SIMPAD_READ_CHUNK && ioRingSetup(&ring, SIMPAD_IO_DEPTH) == 0) {
+        struct iovec slots[SIMPAD_IO_DEPTH];
+        int busy[SIMPAD_IO_DEPTH] = {0};
+        size_t submitted = 0, end = size;
+        int inFlight = 0, error = 0, slot;
+
+        while ((submitted < size && !error) || inFlight > 0) {
+            // Keep the queue full
+            for (slot = 0; slot < SIMPAD_IO_DEPTH && submitted < size && !error; slot++) {
+                if (busy[slot]) continue;
+                slots[slot].iov_base = &buffer[submitted];
+                slots[slot].iov_len = size - submitted < SIMPAD_READ_CHUNK ? size - submitted : SIMPAD_READ_CHUNK;
+                struct io_uring_sqe request;
+                memset(&request, 0, sizeof(request));
+                request.opcode = IORING_OP_READV;
+                request.fd = fd;
+                request.off = submitted;
+                request.addr = (uintptr_t)&slots[slot];
+                request.len = 1;
+                request.user_data = slot;
+                ioRingSubmit(&ring, &request);
+                busy[slot] = 1;
+                inFlight++;
+                submitted += slots[slot].iov_len;
+            }
+
+            struct io_uring_cqe completion;
+            if (!ioRingComplete(&ring, &completion, 1)) {
+                error = errno ? errno : EIO;
+                break; // Nothing more will come back, and the buffer may still be written to, so give up on it
+            }
+            slot = completion.user_data;
+            busy[slot] = 0;
+            inFlight--;
+            char *base = slots[slot].iov_base;
+            size_t length = slots[slot].iov_len;
+            if (completion.res < 0) {
+                error = -completion.res;
+            }
+            else if ((size_t)completion.res < length) {
+                // A short read: read the rest of the chunk the plain way, which also finds the end of the file
+                ssize_t rest = ioReadSync(fd, base + completion.res, length - completion.res, (base - buffer) + completion.res);
+                if (rest == -1) {
+                    error = errno;
                 }
-                i++;
-                previousSeparator = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\''){ // Doublequoted and single quoted strings (if we are not currently in a string)
-                    inString = c;
-                    row->highlight[i] = HIGHLIGHT_STRING;
-                    i++;
-                    continue;
+                else if (completion.res + rest < (ssize_t)length && (size_t)(base - buffer) + completion.res + rest < end) {
+                    end = (base - buffer) + completion.res + rest;
                 }
             }
         }
+        ioRingTeardown(&ring);
+        if (error) {
+            if (inFlight > 0) die("io_uring");
+            errno = error;
+            return -1;
+        }
+        return end;
+    }
+#endif
+    return ioReadSync(fd, buffer, size, 0);
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) { // Check if the number should even be highlighted for that current filetype
-            // Color all numbers from now on (We can also now read numbers with a decimal)
-            if ((isdigit(c) && (previousSeparator || previousHighlight == HIGHLIGHT_NUMBER)) || 
-                (c == '.' && previousHighlight == HIGHLIGHT_NUMBER)){
-                row->highlight[i] = HIGHLIGHT_NUMBER;
-                i++;
-                previousSeparator = 0;
+// A batch of pieces to write at one offset. A batch can also have a buffer of its own (SIMPAD_SAVE_BUFFER bytes),
+// which io_uring knows about in advance, so writes from it skip mapping the pages in each time
+struct ioBatch {
+    struct iovec iov[SIMPAD_IOV_BATCH];
+    int count;
+    size_t length; // Bytes in the batch
+    off_t offset;
+    char *buffer;
+    int busy; // Queued in the kernel and not finished yet
+};
+
+// A file being written a batch at a time. Handing a batch over may return before it is written, so a batch is only
+// refilled once it has come back, and ioWriterFinish waits for all of them
+struct ioWriter {
+    int fd;
+    size_t *progress; // Bytes written so far, updated atomically
+    int error; // The first error hit, or 0
+    struct ioBatch *batches;
+    int next; // The batch handed out next
+#ifdef SIMPAD_IO_URING
+    int uring;
+    int registered; // The batches' buffers are registered with the ring
+    struct ioRing ring;
+#endif
+};
+
+void ioWriterOpen(struct ioWriter *writer, int fd, size_t *progress) {
+    writer->fd = fd;
+    writer->progress = progress;
+    writer->error = 0;
+    writer->next = 0;
+    writer->batches = calloc(SIMPAD_IO_DEPTH, sizeof(struct ioBatch));
+    if (writer->batches == NULL) {
+        die("calloc");
+    }
+#ifdef SIMPAD_IO_URING
+    writer->uring = ioRingSetup(&writer->ring, SIMPAD_IO_DEPTH) == 0;
+    writer->registered = 0;
+#endif
+}
+
+// Give every batch a buffer of its own, for writers that gather bytes up rather than pointing at them
+void ioWriterUseBuffers(struct ioWriter *writer) {
+    int i;
+    for (i = 0; i < SIMPAD_IO_DEPTH; i++) {
+        writer->batches[i].buffer = malloc(SIMPAD_SAVE_BUFFER);
+        if (writer->batches[i].buffer == NULL) {
+            die("malloc");
+        }
+    }
+#ifdef SIMPAD_IO_URING
+    if (writer->uring) {
+        struct iovec buffers[SIMPAD_IO_DEPTH];
+        for (i = 0; i < SIMPAD_IO_DEPTH; i++) {
+            buffers[i].iov_base = writer->batches[i].buffer;
+            buffers[i].iov_len = SIMPAD_SAVE_BUFFER;
+        }
+        // Registering pins the buffers, which the memlock limit may not allow; they still work unregistered
+        writer->registered = syscall(__NR_io_uring_register, writer->ring.fd, IORING_REGISTER_BUFFERS, buffers, SIMPAD_IO_DEPTH) == 0;
+    }
+#endif
+}
+
+// Write a batch (from done bytes in) with plain syscalls
+void ioBatchWriteSync(struct ioWriter *writer, struct ioBatch *batch, size_t done) {
+    struct iovec *iov = batch->iov;
+    int count = batch->count;
+    off_t offset = batch->offset + done;
+
+    while (count > 0) {
+        // Skip whatever has been written already
+        while (count > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count == 0) break;
+        iov->iov_base = (char *)iov->iov_base + done;
+        iov->iov_len -= done;
+
+        __sync_add_and_fetch(&E.io.writes, 1);
+        ssize_t written = pwritev(writer->fd, iov, count, offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                done = 0;
                 continue;
             }
+            if (!writer->error) writer->error = errno;
+            return;
         }
-        // We don't want to highlight keywords that exist within a string, so we ensure theres a separator
-        if (previousSeparator) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int keywordLen = strlen(keywords[j]);
-                int keywordType = keywords[j][keywordLen - 1] == '|';
-                if (keywordType) keywordLen--;
+        __sync_add_and_fetch(writer->progress, written);
+        offset += written;
+        done = written;
+    }
+}
 
-                if (!strncmp(&row->render[i], keywords[j], keywordLen) &&
-                    isSeparator(row->render[i + keywordLen])) {
-                        memset(&row->highlight[i], keywordType ? HIGHLIGHT_KEYWORD_TYPE : HIGHLIGHT_KEYWORD, keywordLen);
-                        i += keywordLen;
-                        break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                previousSeparator = 0;
-                continue;
+#ifdef SIMPAD_IO_URING
+// Deal with finished writes, waiting for one if asked to
+void ioWriterReap(struct ioWriter *writer, int wait) {
+    struct io_uring_cqe completion;
+    while (ioRingComplete(&writer->ring, &completion, wait)) {
+        struct ioBatch *batch = &writer->batches[completion.user_data];
+        batch->busy = 0;
+        if (completion.res < 0) {
+            if (!writer->error) writer->error = -completion.res;
+        }
+        else {
+            __sync_add_and_fetch(writer->progress, completion.res);
+            if ((size_t)completion.res < batch->length) {
+                ioBatchWriteSync(writer, batch, completion.res); // A short write: finish it off the plain way
             }
         }
+        wait = 0;
+    }
+}
+#endif
+
+// Get an empty batch to fill, waiting for it to come back from the kernel if it is still being written
+struct ioBatch *ioWriterNext(struct ioWriter *writer) {
+    struct ioBatch *batch = &writer->batches[writer->next];
+    writer->next = (writer->next + 1) % SIMPAD_IO_DEPTH;
+#ifdef SIMPAD_IO_URING
+    while (batch->busy) {
+        ioWriterReap(writer, 1);
+    }
+#endif
+    batch->count = 0;
+    batch->length = 0;
+    return batch;
+}
 
-        previousSeparator = isSeparator(c);
-        i++;
+// Write a filled batch at offset. With io_uring it is only queued, and must not be touched until it comes back
+void ioWriterSubmit(struct ioWriter *writer, struct ioBatch *batch, off_t offset) {
+    batch->offset = offset;
+    if (writer->error || batch->length == 0) return;
+
+#ifdef SIMPAD_IO_URING
+    if (writer->uring) {
+        struct io_uring_sqe request;
+        memset(&request, 0, sizeof(request));
+        request.fd = writer->fd;
+        request.off = offset;
+        request.user_data = batch - writer->batches;
+        if (writer->registered && batch->count == 1) {
+            request.opcode = IORING_OP_WRITE_FIXED;
+            request.addr = (uintptr_t)batch->iov[0].iov_base;
+            request.len = batch->iov[0].iov_len;
+            request.buf_index = batch - writer->batches;
+        }
+        else {
+            request.opcode = IORING_OP_WRITEV;
+            request.addr = (uintptr_t)batch->iov;
+            request.len = batch->count;
+        }
+        batch->busy = 1;
+        ioRingSubmit(&writer->ring, &request);
+        ioWriterReap(writer, 0);
+        return;
     }
-    // If we have not closed a comment, then we must change all the following syntax to be highlighted until we close the comment
-    int isChanged = (row->highlightOpenComment != inComment);
-    row->highlightOpenComment = inComment; // Set current row openComment value to whatever state was left over (open / closed)
-    if (isChanged && row->index + 1 < E.numRows)
-        editorUpdateSyntax(&E.row[row->index+1]);
+#endif
+    ioBatchWriteSync(writer, batch, 0);
 }
 
-int editorSyntaxToColor(int highlight){
-    switch (highlight){
-        case HIGHLIGHT_MULTILINE_COMMENT:
-        case HIGHLIGHT_COMMENT:
-            return 36; // Cyan
+// Wait for every write to be done and let go of the writer. Returns -1 (with errno set) if any of them failed
+int ioWriterFinish(struct ioWriter *writer) {
+    int i;
+#ifdef SIMPAD_IO_URING
+    if (writer->uring) {
+        for (i = 0; i < SIMPAD_IO_DEPTH; i++) {
+            while (writer->batches[i].busy) {
+                ioWriterReap(writer, 1);
+            }
+        }
+        ioRingTeardown(&writer->ring);
+    }
+#endif
+    for (i = 0; i < SIMPAD_IO_DEPTH; i++) {
+        free(writer->batches[i].buffer);
+    }
+    free(writer->batches);
+    if (writer->error) {
+        errno = writer->error;
+        return -1;
+    }
+    return 0;
+}
+
+/************ PIECE TABLE ************/
+
+// Size of each block of the add buffer (a piece bigger than this gets a block of its own)
+#define ADD_BLOCK_SIZE (64 * 1024)
+
+struct pieceStore *pieceStoreNew() {
+    struct pieceStore *store = calloc(1, sizeof(struct pieceStore));
+    if (store == NULL) {
+        die("calloc");
+    }
+    store->references = 1;
+    return store;
+}
+
+// References are counted atomically, since a snapshot may be let go of on another thread
+void pieceStoreRetain(struct pieceStore *store) {
+    __sync_add_and_fetch(&store->references, 1);
+}
+
+void pieceStoreRelease(struct pieceStore *store) {
+    if (store == NULL || __sync_sub_and_fetch(&store->references, 1) > 0) return;
+
+    while (store->add) {
+        struct addBlock *next = store->add->next;
+        free(store->add);
+        store->add = next;
+    }
+    if (store->mapped) {
+        munmap(store->orig, store->origSize);
+    }
+    else {
+        free(store->orig);
+    }
+    free(store);
+}
+
+// Fill the original buffer from an open file. Mapping a big file means nothing is copied and pages are only
+// read in once a row on them is looked at; a small one (or anything that cannot be mapped) is read in
+void pieceStoreLoad(struct pieceStore *store, int fd, size_t size) {
+    fstat(fd, &store->origStat);
+    if (size >= SIMPAD_MAP_MIN) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            store->orig = map;
+            store->origSize = size;
+            store->mapped = 1;
+            return;
+        }
+    }
+
+    store->orig = malloc(size + 1);
+    if (store->orig == NULL) {
+        die("malloc");
+    }
+    store->mapped = 0;
+    ssize_t bytesRead = ioReadAll(fd, store->orig, size);
+    if (bytesRead == -1) {
+        die("read");
+    }
+    store->origSize = bytesRead;
+}
+
+// Touching a page of a mapped file past its end, once it has been cut short on disk, raises SIGBUS. Rather than
+// dying with the edits, the page is swapped for one of zeros (the bytes are gone anyway) and the user is told
+void editorMapFault(int signal, siginfo_t *info, void *context) {
+    (void)context;
+    if (info->si_code == BUS_ADRERR) {
+        void *page = (void *)((uintptr_t)info->si_addr & ~(uintptr_t)(E.pageSize - 1));
+        if (mmap(page, E.pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            E.mapFaults++;
+            return;
+        }
+    }
+    // Not a mapping gone short, so it is a real crash: the access faults again, this time with the default action
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, NULL);
+}
+
+void editorMapGuard() {
+    E.pageSize = sysconf(_SC_PAGESIZE);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = editorMapFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+// Tell the user once part of the mapped file has turned out to be missing
+int editorMapPoll() {
+    sig_atomic_t faults = E.mapFaults;
+    if (faults == E.mapFaultsSeen) return 0;
+    E.mapFaultsSeen = faults;
+    editorSetStatusMessage("WARNING - File was cut short on disk! Text past its new end reads as zeros");
+    return 1;
+}
+
+// Reserve length bytes at the end of the add buffer and return where they start
+char *addBufferReserve(size_t length) {
+    struct addBlock *block = E.store->add;
+
+    if (block == NULL || block->capacity - block->used < length) {
+        size_t capacity = length > ADD_BLOCK_SIZE ? length : ADD_BLOCK_SIZE;
+        block = malloc(sizeof(struct addBlock) + capacity);
+        if (block == NULL) {
+            die("malloc");
+        }
+        block->next = E.store->add;
+        block->used = 0;
+        block->capacity = capacity;
+        E.store->add = block;
+    }
+    char *start = &block->data[block->used];
+    block->used += length;
+    return start;
+}
+
+// A piece can grow in place only if it ends exactly where the add buffer ends, since nothing after that point is in use yet
+int addBufferCanExtend(const char *pieceEnd, size_t length) {
+    struct addBlock *block = E.store->add;
+    return block && pieceEnd == &block->data[block->used] && block->capacity - block->used >= length;
+}
+
+// Take a block filled somewhere else (such as by a reader thread) into the add buffer. It goes behind the newest
+// block, which is still being typed into, and is never written to again
+void addBufferAdopt(struct addBlock *block) {
+    block->capacity = block->used;
+    if (E.store->add) {
+        block->next = E.store->add->next;
+        E.store->add->next = block;
+    }
+    else {
+        block->next = NULL;
+        E.store->add = block;
+    }
+}
+
+// Write the gap buffer's row back as a piece in the add buffer, so its chars are a flat run again
+void editorGapFlush() {
+    editorRow *row = E.gap.row;
+    if (row == NULL) return;
+
+    char *chars = addBufferReserve(row->size);
+    memcpy(chars, E.gap.buffer, E.gap.gapStart);
+    memcpy(&chars[E.gap.gapStart], &E.gap.buffer[E.gap.gapEnd], E.gap.capacity - E.gap.gapEnd);
+    row->chars = chars;
+    E.gap.row = NULL;
+}
+
+// Make row the one held in the gap buffer with the gap at position at, at least length bytes wide
+void editorGapMoveTo(editorRow *row, size_t at, size_t length) {
+    if (E.gap.row != row) {
+        editorGapFlush();
+        size_t capacity = row->size * 2 + length;
+        if (capacity < 64) capacity = 64;
+        if (capacity > E.gap.capacity) {
+            free(E.gap.buffer);
+            E.gap.buffer = malloc(capacity);
+            if (E.gap.buffer == NULL) {
+                die("malloc");
+            }
+            E.gap.capacity = capacity;
+        }
+        memcpy(E.gap.buffer, row->chars, at);
+        E.gap.gapStart = at;
+        E.gap.gapEnd = E.gap.capacity - (row->size - at);
+        memcpy(&E.gap.buffer[E.gap.gapEnd], &row->chars[at], row->size - at);
+        E.gap.row = row;
+    }
+    // Slide the text between the gap and the new position across it (nothing moves when typing at the cursor)
+    if (at < E.gap.gapStart) {
+        size_t distance = E.gap.gapStart - at;
+        memmove(&E.gap.buffer[E.gap.gapEnd - distance], &E.gap.buffer[at], distance);
+        E.gap.gapStart = at;
+        E.gap.gapEnd -= distance;
+    }
+    else if (at > E.gap.gapStart) {
+        size_t distance = at - E.gap.gapStart;
+        memmove(&E.gap.buffer[E.gap.gapStart], &E.gap.buffer[E.gap.gapEnd], distance);
+        E.gap.gapStart = at;
+        E.gap.gapEnd += distance;
+    }
+    // Double the buffer when the gap runs out, moving the text after the gap to the new end
+    if (E.gap.gapEnd - E.gap.gapStart < length) {
+        size_t capacity = E.gap.capacity * 2 + length;
+        size_t tailLength = E.gap.capacity - E.gap.gapEnd;
+        char *buffer = realloc(E.gap.buffer, capacity);
+        if (buffer == NULL) {
+            die("realloc");
+        }
+        memmove(&buffer[capacity - tailLength], &buffer[E.gap.gapEnd], tailLength);
+        E.gap.buffer = buffer;
+        E.gap.gapEnd = capacity - tailLength;
+        E.gap.capacity = capacity;
+    }
+}
+
+// Get a row's characters as two runs, the text before and after the gap (a row outside the gap buffer is all in the first run)
+void editorRowRuns(editorRow *row, const char *runs[2], int64_t runSizes[2]) {
+    if (row == E.gap.row) {
+        runs[0] = E.gap.buffer;
+        runSizes[0] = E.gap.gapStart;
+        runs[1] = &E.gap.buffer[E.gap.gapEnd];
+        runSizes[1] = E.gap.capacity - E.gap.gapEnd;
+    }
+    else {
+        runs[0] = row->chars;
+        runSizes[0] = row->size;
+        runs[1] = NULL;
+        runSizes[1] = 0;
+    }
+}
+
+// Get a row's characters as one flat run, flushing the gap buffer first if it holds the row
+const char *editorRowChars(editorRow *row) {
+    if (row == E.gap.row) {
+        editorGapFlush();
+    }
+    return row->chars;
+}
+
+int64_t rowTreeCount(rowNode *node) {
+    return node ? node->count : 0;
+}
+
+size_t rowTreeBytes(rowNode *node) {
+    return node ? node->bytes : 0;
+}
+
+// Recompute a node's subtree counts after its children changed, and point the children back at it
+void rowTreeUpdate(rowNode *node) {
+    node->count = 1 + rowTreeCount(node->left) + rowTreeCount(node->right);
+    node->bytes = node->row.size + 1 + rowTreeBytes(node->left) + rowTreeBytes(node->right);
+    if (node->left) node->left->parent = node;
+    if (node->right) node->right->parent = node;
+}
+
+// Xorshift generator used to keep the row tree balanced
+uint64_t rowTreeRandom() {
+    static uint64_t state = 88172645463325252ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Join two trees where every row of a comes before every row of b. The root is picked with probability
+// proportional to subtree size, which keeps the tree balanced in expectation without storing priorities
+rowNode *rowTreeMerge(rowNode *a, rowNode *b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+
+    if (rowTreeRandom() % (uint64_t)(a->count + b->count) < (uint64_t)a->count) {
+        a = rowNodeOwn(a);
+        a->right = rowTreeMerge(a->right, b);
+        rowTreeUpdate(a);
+        return a;
+    }
+    b = rowNodeOwn(b);
+    b->left = rowTreeMerge(a, b->left);
+    rowTreeUpdate(b);
+    return b;
+}
+
+// Split a tree so the first k rows end up in *a and the rest in *b
+void rowTreeSplit(rowNode *node, int64_t k, rowNode **a, rowNode **b) {
+    if (node == NULL) {
+        *a = NULL;
+        *b = NULL;
+        return;
+    }
+    node = rowNodeOwn(node);
+    if (rowTreeCount(node->left) < k) {
+        rowTreeSplit(node->right, k - rowTreeCount(node->left) - 1, &node->right, b);
+        rowTreeUpdate(node);
+        *a = node;
+    }
+    else {
+        rowTreeSplit(node->left, k, a, &node->left);
+        rowTreeUpdate(node);
+        *b = node;
+    }
+}
+
+rowNode *rowTreeFirst(rowNode *node) {
+    while (node && node->left) node = node->left;
+    return node;
+}
+
+rowNode *rowTreeLast(rowNode *node) {
+    while (node && node->right) node = node->right;
+    return node;
+}
+
+// Build a perfectly balanced tree out of n new rows, linking them in order behind *last as it goes
+int editorThreadCount() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    if (cpus > SIMPAD_MAX_THREADS) return SIMPAD_MAX_THREADS;
+    return cpus;
+}
+
+// Building part of a block of rows: the nodes from low up to (not including) high, which become a subtree
+struct rowTreeBuildJob {
+    rowNode *nodes; // The whole block, one node per line
+    const struct rowPiece *lines;
+    int64_t n; // Rows in the whole block
+    int64_t low, high;
+    int threads; // Threads this job may use, counting its own
+    rowNode *root;
+};
+
+// Build a perfectly balanced subtree out of a range of the block. A big enough left half is handed to a new
+// thread while this one builds the right half, so a large file is built on every core
+void *rowTreeBuildRange(void *argument) {
+    struct rowTreeBuildJob *job = argument;
+    if (job->low >= job->high) {
+        job->root = NULL;
+        return NULL;
+    }
+
+    int64_t middle = job->low + (job->high - job->low) / 2;
+    struct rowTreeBuildJob left = *job, right = *job;
+    left.high = middle;
+    right.low = middle + 1;
+
+    pthread_t thread;
+    int spawned = 0;
+    if (job->threads > 1 && middle - job->low >= SIMPAD_BUILD_CHUNK) {
+        left.threads = job->threads / 2;
+        right.threads = job->threads - left.threads;
+        spawned = pthread_create(&thread, NULL, rowTreeBuildRange, &left) == 0;
+    }
+    if (!spawned) rowTreeBuildRange(&left);
+    rowTreeBuildRange(&right);
+    if (spawned) pthread_join(thread, NULL);
+
+    rowNode *node = &job->nodes[middle];
+    node->row.size = job->lines[middle].size;
+    node->row.chars = job->lines[middle].chars;
+    node->row.renderSize = 0;
+    node->row.render = NULL;
+    node->row.highlight = NULL;
+    node->row.highlightOpenComment = 0;
+    node->row.flags = 0;
+    node->row.version = E.treeVersion;
+
+    // Neighbours in the block are neighbours in memory
+    node->previous = middle > 0 ? node - 1 : NULL;
+    node->next = middle + 1 < job->n ? node + 1 : NULL;
+
+    node->parent = NULL;
+    node->left = left.root;
+    node->right = right.root;
+    rowTreeUpdate(node);
+    job->root = node;
+    return NULL;
+}
+
+// Turn n lines into a balanced tree of rows, linked in order from nodes[0] to nodes[n - 1]
+rowNode *rowTreeBuild(rowNode *nodes, const struct rowPiece *lines, int64_t n) {
+    int threads = n >= 2 * SIMPAD_BUILD_CHUNK ? editorThreadCount() : 1; // Small inserts (such as typing) stay on this thread
+    struct rowTreeBuildJob job = {nodes, lines, n, 0, n, threads, NULL};
+    rowTreeBuildRange(&job);
+    return job.root;
+}
+
+// Carry a change in a row's length up through the byte counts above it, stopping as soon as nothing changes
+void rowTreeResize(rowNode *node) {
+    while (node) {
+        size_t bytes = node->row.size + 1 + rowTreeBytes(node->left) + rowTreeBytes(node->right);
+        if (bytes == node->bytes) return;
+        node->bytes = bytes;
+        node = node->parent;
+    }
+}
+
+// Get a row ready to be changed. If it is shared with a snapshot it is copied, and so is every node above it (each
+// of them has to point at the copy below it instead), and the copy is the row to change from then on
+editorRow *editorRowWritable(editorRow *row) {
+    rowNode *node = rowNodeLive((rowNode *)row);
+    if (!rowNodeFrozen(node)) return &node->row;
+
+    rowNode *parent = node->parent ? (rowNode *)editorRowWritable(&node->parent->row) : NULL;
+    rowNode *copy = rowNodeCopy(node);
+    copy->parent = parent;
+    if (parent == NULL) E.rows = copy;
+    else if (parent->left == node) parent->left = copy;
+    else parent->right = copy;
+    return &copy->row;
+}
+
+// Find the row at a given line number by walking down the subtree counts
+editorRow *editorRowAt(int64_t at) {
+    rowNode *node = E.rows;
+
+    while (node) {
+        int64_t leftCount = rowTreeCount(node->left);
+        if (at < leftCount) {
+            node = node->left;
+        }
+        else if (at == leftCount) {
+            return &node->row;
+        }
+        else {
+            at -= leftCount + 1;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+editorRow *editorRowNext(editorRow *row) {
+    return (editorRow *)((rowNode *)row)->next;
+}
+
+editorRow *editorRowPrevious(editorRow *row) {
+    return (editorRow *)((rowNode *)row)->previous;
+}
+
+// Byte offset of the start of a row in the file as it would be saved, summed from the subtree byte counts
+size_t editorRowOffset(editorRow *row) {
+    rowNode *node = (rowNode *)row;
+    size_t offset = rowTreeBytes(node->left);
+
+    while (node->parent) {
+        if (node == node->parent->right) {
+            offset += rowTreeBytes(node->parent->left) + node->parent->row.size + 1;
+        }
+        node = node->parent;
+    }
+    return offset;
+}
+
+// Find the line holding a byte offset, and where in the line it falls (an offset past the end gives E.numRows)
+int64_t editorLineAtOffset(size_t offset, size_t *column) {
+    rowNode *node = E.rows;
+    int64_t line = 0;
+
+    while (node) {
+        size_t leftBytes = rowTreeBytes(node->left);
+        if (offset < leftBytes) {
+            node = node->left;
+        }
+        else if (offset - leftBytes <= (size_t)node->row.size) {
+            *column = offset - leftBytes;
+            return line + rowTreeCount(node->left);
+        }
+        else {
+            offset -= leftBytes + node->row.size + 1;
+            line += rowTreeCount(node->left) + 1;
+            node = node->right;
+        }
+    }
+    *column = 0;
+    return line;
+}
+
+// The line number of a row is the number of rows that come before it in the tree
+int64_t editorRowIndex(editorRow *row) {
+    rowNode *node = (rowNode *)row;
+    int64_t index = rowTreeCount(node->left);
+
+    while (node->parent) {
+        if (node == node->parent->right) {
+            index += rowTreeCount(node->parent->left) + 1;
+        }
+        node = node->parent;
+    }
+    return index;
+}
+
+/************ SYNTAX HIGHLIGHTING ************/
+
+// Whether s appears at position i of a row's render. Comparisons never read past renderSize, since a render that
+// shares its row's piece is followed by whatever comes next in the buffer rather than a NUL byte
+int editorRenderHas(editorRow *row, int64_t i, const char *s, int length) {
+    return i + length <= row->renderSize && !memcmp(&row->render[i], s, length);
+}
+
+// A function that takes a character and returns true if it is considered a separator character
+int isSeparator(int c){
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// Highlight a single row, and return whether it changed from opening to closing a multiline comment (or the reverse)
+int editorHighlightRow(editorRow *row){
+    if (row->render == NULL) return 0; // Not rendered yet, it gets highlighted when it is
+    memset(row->highlight, HIGHLIGHT_NORMAL, row->renderSize); // Set all characters in the row array to the default highlight value
+
+    if (E.syntax == NULL) return 0; // Do nothing 
+
+    char **keywords = E.syntax->keywords;
+
+    // Aliases for singleline, multiline start, and multiline end comment chars
+    char *scs = E.syntax->singleLineCmtStart;
+    char *mcs = E.syntax->multilineCommentStart;
+    char *mce = E.syntax->multilineCommentEnd;
+
+    int scsLen = scs ? strlen(scs) : 0;
+    int mcsLen = mcs ? strlen(mcs) : 0;
+    int mceLen = mce ? strlen(mce) : 0;
+
+    int previousSeparator = 1; // Beginning of a line is considered a separator, defaulted to true
+    int inString = 0; // Tells us if we are in a string or not (until we hit a closing quote)
+    editorRow *previous = editorRowPrevious(row);
+    int inComment = (previous && previous->highlightOpenComment); // Keep track of if we are in a comment (only for multiline)
+
+    int64_t i = 0;
+    while (i < row->renderSize){
+        char c = row->render[i];
+        unsigned char previousHighlight = (i > 0) ? row->highlight[i - 1] : HIGHLIGHT_NORMAL;
+
+        // Ensure we are not in a string / comment and that there is some length to the comment
+        if (scsLen && !inString && !inComment) {
+            // Check if the character is the start of a single line comment
+            if (editorRenderHas(row, i, scs, scsLen)) {
+                memset(&row->highlight[i], HIGHLIGHT_COMMENT, row->renderSize - i);
+                break;
+            }
+        }
+        // Ensure the strings are of length > 0, and ensure we are not in a string
+        if (mcsLen && mceLen && !inString) {
+            if (inComment) {
+                // Begin highlighting the comment if inside a comment
+                row->highlight[i] = HIGHLIGHT_MULTILINE_COMMENT;
+                if (editorRenderHas(row, i, mce, mceLen)){
+                    memset(&row->highlight[i], HIGHLIGHT_MULTILINE_COMMENT, mceLen);
+                    i += mceLen;
+                    inComment = 0;
+                    previousSeparator = 1;
+                    continue;
+                }
+                else {
+                    i++;
+                    continue;
+                }
+            }
+            // If we are not in a ml comment, we check if we are at the beginning
+            else if (editorRenderHas(row, i, mcs, mceLen)) {
+                memset(&row->highlight[i], HIGHLIGHT_MULTILINE_COMMENT, mcsLen);
+                i += mcsLen;
+                inComment = 1;
+                continue;
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (inString) {
+                row->highlight[i] = HIGHLIGHT_STRING;
+                // Exempt escaped quotes, which don't close the string
+                if (c == '\\' && i + 1 < row->renderSize) {
+                    row->highlight[i + 1] = HIGHLIGHT_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == inString) {
+                    inString = 0;
+                }
+                i++;
+                previousSeparator = 1;
+                continue;
+            } else {
+                if (c == '"' || c == '\''){ // Doublequoted and single quoted strings (if we are not currently in a string)
+                    inString = c;
+                    row->highlight[i] = HIGHLIGHT_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) { // Check if the number should even be highlighted for that current filetype
+            // Color all numbers from now on (We can also now read numbers with a decimal)
+            if ((isdigit(c) && (previousSeparator || previousHighlight == HIGHLIGHT_NUMBER)) || 
+                (c == '.' && previousHighlight == HIGHLIGHT_NUMBER)){
+                row->highlight[i] = HIGHLIGHT_NUMBER;
+                i++;
+                previousSeparator = 0;
+                continue;
+            }
+        }
+        // We don't want to highlight keywords that exist within a string, so we ensure theres a separator
+        if (previousSeparator) {
+            int j;
+            for (j = 0; keywords[j]; j++) {
+                int keywordLen = strlen(keywords[j]);
+                int keywordType = keywords[j][keywordLen - 1] == '|';
+                if (keywordType) keywordLen--;
+
+                if (editorRenderHas(row, i, keywords[j], keywordLen) &&
+                    (i + keywordLen == row->renderSize || isSeparator(row->render[i + keywordLen]))) {
+                        memset(&row->highlight[i], keywordType ? HIGHLIGHT_KEYWORD_TYPE : HIGHLIGHT_KEYWORD, keywordLen);
+                        i += keywordLen;
+                        break;
+                }
+            }
+            if (keywords[j] != NULL) {
+                previousSeparator = 0;
+                continue;
+            }
+        }
+
+        previousSeparator = isSeparator(c);
+        i++;
+    }
+    int isChanged = (row->highlightOpenComment != inComment);
+    row->highlightOpenComment = inComment; // Set current row openComment value to whatever state was left over (open / closed)
+    return isChanged;
+}
+
+// If we have not closed a comment, then we must change all the following syntax to be highlighted until we close the comment
+void editorUpdateSyntax(editorRow *row){
+    while (row && editorHighlightRow(row)) {
+        row = editorRowNext(row);
+    }
+}
+
+int editorSyntaxToColor(int highlight){
+    switch (highlight){
+        case HIGHLIGHT_MULTILINE_COMMENT:
+        case HIGHLIGHT_COMMENT:
+            return 36; // Cyan
         case HIGHLIGHT_KEYWORD:
             return 33; // Yellow
         case HIGHLIGHT_KEYWORD_TYPE:
@@ -438,273 +1924,3235 @@ int editorSyntaxToColor(int highlight){
         case HIGHLIGHT_MATCH:
             return 34; // Blue
         default:
-            return 37; // White 
+            return 37; // White 
+    }
+}
+
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    if (E.fileName == NULL) return; // If there is no file name or there is no match, then there is no filetype
+
+    // Isolate the extension (find the last occurrence of the . character)
+    char *extension = strrchr(E.fileName, '.'); 
+
+    for (unsigned int j = 0; j < highlightDBEntries; j++) {
+        struct editorSyntax *s = &highlightDB[j];
+
+        unsigned int i = 0;
+
+        while (s->fileMatch[i]) {
+            int isExtension = (s->fileMatch[i][0] == '.');
+            if ((isExtension && extension && !strcmp(extension, s->fileMatch[i])) || 
+                (!isExtension && strstr(E.fileName, s->fileMatch[i]))) {
+                    E.syntax = s;
+
+                    // Once we set the filetype after creating a file, we re-highlight everything (top to bottom, so comments carry over)
+                    editorRow *row;
+                    for (row = editorRowAt(0); row; row = editorRowNext(row)){
+                        editorHighlightRow(row);
+                    }
+                    return;
+            }
+            i++;
+        }
+    }
+}
+
+/************ ROW OPERATIONS ************/
+
+// Record that the buffer changed at a byte offset. Only the lowest such offset is kept: everything before it is
+// still exactly as it is on disk, however the bytes after it have moved since
+void editorMarkDirty(size_t offset) {
+    if (offset < E.dirtyFrom) {
+        E.dirtyFrom = offset;
+    }
+}
+
+int editorIsDirty() {
+    return E.dirtyFrom != SIZE_MAX;
+}
+
+// Convert a chars index to a render index, and figure out how many spaces each tabbed space occupies
+int64_t editorRowCursorXToRenderX(editorRow *row, int64_t cursorX){
+    const char *runs[2];
+    int64_t runSizes[2];
+    int64_t renderX = 0;
+    int64_t i;
+    int run;
+
+    editorRowRuns(row, runs, runSizes);
+    for (run = 0; run < 2; run++) {
+        for (i = 0; i < runSizes[run] && cursorX > 0; i++, cursorX--){
+            if (runs[run][i] == '\t'){
+                renderX += (SIMPAD_TAB_STOP - 1) - (renderX % SIMPAD_TAB_STOP);
+            }
+            renderX++;
+        }
+    }
+    return renderX;
+}
+
+int64_t editorRowRenderXToCursorX(editorRow *row, int64_t renderX){
+    const char *chars = editorRowChars(row);
+    int64_t cursorRenderX = 0;
+    int64_t cursorX;
+    for (cursorX = 0; cursorX < row->size; cursorX++){
+        if (chars[cursorX] == '\t'){
+            cursorRenderX += (SIMPAD_TAB_STOP - 1) - (cursorRenderX % SIMPAD_TAB_STOP);
+        }
+        cursorRenderX++;
+
+        if (cursorRenderX > renderX) return cursorX;
+    }
+    return cursorX;
+}
+
+// Bytes of a row's payload: the highlight array, followed by the render when the row owns one
+size_t editorRowPayloadSize(editorRow *row) {
+    return row->renderSize + ((row->flags & ROW_RENDER_OWNED) ? row->renderSize + 1 : 0);
+}
+
+// Short rows keep their payload inside the row itself, and only longer ones spill to the arena
+unsigned char *editorRowAllocPayload(editorRow *row, size_t size) {
+    if (size <= ROW_INLINE_SIZE) {
+        row->flags |= ROW_PAYLOAD_INLINE;
+        return row->inlinePayload;
+    }
+    row->flags &= ~ROW_PAYLOAD_INLINE;
+    return arenaAlloc(size);
+}
+
+void editorRowFreePayload(editorRow *row) {
+    if (row->highlight && !(row->flags & ROW_PAYLOAD_INLINE)) {
+        arenaFree(row->highlight, editorRowPayloadSize(row));
+    }
+}
+
+// Reads the characters from an editorRow to fill the contents of a 
+// rendered row (The one to ACTUALLY be displayed)
+void editorUpdateRow(editorRow *row){
+    const char *runs[2];
+    int64_t runSizes[2];
+    int64_t renderSize = 0;
+    int64_t tabs = 0;
+    int64_t i;
+    int run;
+
+    rowTreeResize((rowNode *)row); // The row may have changed length since it was last rendered
+
+    // The row under the cursor is rendered straight from both sides of the gap, without flattening it first
+    editorRowRuns(row, runs, runSizes);
+    for (run = 0; run < 2; run++) {
+        for (i = 0; i < runSizes[run]; i++) {
+            if (runs[run][i] == '\t') {
+                renderSize += SIMPAD_TAB_STOP - renderSize % SIMPAD_TAB_STOP;
+                tabs++;
+            }
+            else renderSize++;
+        }
+    }
+    editorRowFreePayload(row);
+
+    // A flat row without tabs renders exactly as its chars, so the render shares the piece instead of copying it
+    if (tabs == 0 && runs[1] == NULL) {
+        row->flags &= ~ROW_RENDER_OWNED;
+        row->highlight = editorRowAllocPayload(row, renderSize);
+        row->render = row->chars;
+        row->renderSize = renderSize;
+    }
+    else {
+        row->flags |= ROW_RENDER_OWNED;
+        row->highlight = editorRowAllocPayload(row, 2 * (size_t)renderSize + 1);
+        char *render = (char *)&row->highlight[renderSize];
+
+        // Render tabs as multiple spaces
+        int64_t index = 0;
+        for (run = 0; run < 2; run++) {
+            for (i = 0; i < runSizes[run]; i++){
+                if (runs[run][i] == '\t'){
+                    render[index++] = ' ';
+                    while(index % SIMPAD_TAB_STOP != 0) {
+                        render[index++] = ' ';
+                    }
+                } else {
+                    render[index++] = runs[run][i];
+                } 
+            }
+        }
+        // Index now contains the number of chars copied into render
+        render[index] = '\0';
+        row->render = render;
+        row->renderSize = index;
+    }
+
+    // Update the highlighted array (All we are doing is updating the array in the event we choose to highlight it)
+    editorUpdateSyntax(row);
+}
+
+// Throw away a row's render and highlight, so they are built again the next time the row is needed
+void editorRowUnrender(editorRow *row) {
+    editorRowFreePayload(row);
+    row->render = NULL;
+    row->highlight = NULL;
+    row->renderSize = 0;
+    row->flags &= ~(ROW_RENDER_OWNED | ROW_PAYLOAD_INLINE);
+}
+
+// Rows are only rendered and highlighted once they are drawn or edited. Whether a row starts inside a multiline
+// comment depends on the rows above it, so unrendered rows above are rendered first (but only so far back)
+void editorRowMaterialize(editorRow *row) {
+    if (row->render) return;
+
+    editorRow *first = row;
+    editorRow *previous;
+    int lookback;
+    for (lookback = 0; lookback < SIMPAD_HIGHLIGHT_LOOKBACK; lookback++) {
+        previous = editorRowPrevious(first);
+        if (previous == NULL || previous->render) break;
+        first = previous;
+    }
+    while (first != row) {
+        editorUpdateRow(first);
+        first = editorRowNext(first);
+    }
+    editorUpdateRow(row);
+}
+
+// Insert n rows before row at in one go: the new rows are built into a balanced tree of their own and joined
+// in with a single split and merge. The rows take their pieces rather than copying them, so the characters
+// must live in the original buffer, the add buffer or a literal. Nothing is rendered until it is needed
+void editorInsertRows(int64_t at, const struct rowPiece *lines, int64_t n) {
+    if (at < 0 || at > E.numRows || n <= 0) return;
+
+    rowNode *nodes = rowNodeAllocBlock(n);
+    rowNode *before, *after;
+    rowTreeSplit(E.rows, at, &before, &after);
+    editorMarkDirty(rowTreeBytes(before));
+    rowNode *block = rowTreeBuild(nodes, lines, n);
+    rowNode *first = &nodes[0];
+    rowNode *last = &nodes[n - 1];
+
+    // Stitch the new rows into the in-order links
+    first->previous = rowTreeLast(before);
+    last->next = rowTreeFirst(after);
+    if (first->previous) first->previous->next = first;
+    if (last->next) last->next->previous = last;
+
+    E.rows = rowTreeMerge(rowTreeMerge(before, block), after);
+    E.rows->parent = NULL;
+    E.numRows += n;
+
+    // The row below may now start in a different comment state, so it is highlighted again along with the new rows
+    if (last->next) editorRowUnrender(&last->next->row);
+}
+
+void editorInsertRow(int64_t at, const char *s, size_t length) {
+    editorJournalRecord(JOURNAL_INSERT_ROW, editorRowAt(at), 0, s, length);
+    struct rowPiece line = {s, length};
+    editorInsertRows(at, &line, 1);
+}
+// Free the memory occupied by the editor row we are freeing (its chars belong to the piece table)
+void editorFreeRow(editorRow *row){
+    editorRowFreePayload(row);
+}
+
+void editorDeleteRow(int64_t at){
+    if (at < 0 || at >= E.numRows) return; // Validate the at index
+    editorJournalRecord(JOURNAL_DELETE_ROW, editorRowAt(at), 0, NULL, 0);
+
+    rowNode *before, *node, *after;
+    rowTreeSplit(E.rows, at, &before, &node);
+    editorMarkDirty(rowTreeBytes(before));
+    rowTreeSplit(node, 1, &node, &after);
+    if (node->previous) node->previous->next = node->next;
+    if (node->next) {
+        node->next->previous = node->previous;
+        editorRowUnrender(&node->next->row); // Its comment state came from the row being deleted
+    }
+    if (E.gap.row == &node->row) E.gap.row = NULL; // Nothing to flush for a row that is going away
+    editorFreeRow(&node->row);
+    rowNodeFree(node);
+
+    E.rows = rowTreeMerge(before, after);
+    if (E.rows) E.rows->parent = NULL;
+    E.numRows--; // Decrement the total number of rows by 1
+}
+
+void editorRowInsertCharacter(editorRow *row, int64_t at, int character) {
+    row = editorRowWritable(row);
+    if (at < 0 || at > row->size) at = row->size;
+    char c = character;
+    editorJournalRecord(JOURNAL_INSERT_CHARACTER, row, at, &c, 1);
+    editorMarkDirty(editorRowOffset(row) + at);
+    editorGapMoveTo(row, at, 1);
+    E.gap.buffer[E.gap.gapStart++] = character;
+    row->size++;
+
+    editorUpdateRow(row);
+}
+
+void editorRowAppendString(editorRow *row, const char *s, size_t length){
+    row = editorRowWritable(row);
+    editorJournalRecord(JOURNAL_APPEND_STRING, row, row->size, s, length);
+    editorMarkDirty(editorRowOffset(row) + row->size);
+    editorRowChars(row); // Flatten the row if it is in the gap buffer
+    if (addBufferCanExtend(row->chars + row->size, length)) {
+        memcpy(addBufferReserve(length), s, length);
+    }
+    else {
+        // Copy the row followed by the string to the end of the add buffer
+        char *chars = addBufferReserve(row->size + length);
+        memcpy(chars, row->chars, row->size);
+        memcpy(&chars[row->size], s, length);
+        row->chars = chars;
+    }
+    row->size += length;
+    editorUpdateRow(row);
+}
+
+void editorRowDeleteCharacter(editorRow *row, int64_t at) {
+    row = editorRowWritable(row);
+    if (at < 0 || at >= row->size) return;
+    editorJournalRecord(JOURNAL_DELETE_CHARACTER, row, at, NULL, 0);
+    editorMarkDirty(editorRowOffset(row) + at);
+    // Put the gap just after the character and widen it backwards over it (a run of backspaces moves nothing)
+    editorGapMoveTo(row, at + 1, 0);
+    E.gap.gapStart--;
+    row->size--;
+    editorUpdateRow(row);
+}
+
+// Cut a row short, after what was past length has been moved to a row of its own
+void editorRowTruncate(editorRow *row, size_t length) {
+    row = editorRowWritable(row);
+    editorJournalRecord(JOURNAL_TRUNCATE_ROW, row, length, NULL, 0);
+    editorMarkDirty(editorRowOffset(row) + length);
+    editorRowChars(row); // Flatten the row if it is in the gap buffer
+    row->size = length;
+    editorUpdateRow(row);
+}
+
+/************ EDITOR OPERATIONS ************/
+
+void editorInsertCharacter(int c) {
+    if (E.cursorY == E.numRows) {
+        editorInsertRow(E.numRows, "", 0);
+    }
+    editorRowInsertCharacter(editorRowAt(E.cursorY), E.cursorX, c);
+    E.cursorX++;
+}
+
+void editorInsertNewline() {
+    // If we are at the beginning of a line
+    if (E.cursorX == 0){
+        editorInsertRow(E.cursorY, "", 0);
+    }
+    else {
+        editorRow *row = editorRowAt(E.cursorY);
+        editorInsertRow(E.cursorY + 1, &editorRowChars(row)[E.cursorX], row->size - E.cursorX); // The new row shares the characters right of the cursor with this row's piece
+        editorRowTruncate(row, E.cursorX); // Truncate the row we are on to where the cursor is
+    }
+    E.cursorY++;
+    E.cursorX = 0; // Move cursor down a line to the start
+}
+
+void editorDeleteCharacter() {
+    if (E.cursorY == E.numRows) return; // If the cursor is past the end of the file, nothing to delete
+    if (E.cursorX == 0 && E.cursorY == 0) return; // If the cursor is at the beginning of the first line, do nothing
+
+    editorRow *row = editorRowAt(E.cursorY); // get the row the cursor is on
+    if (E.cursorX > 0){
+        editorRowDeleteCharacter(row, E.cursorX - 1); // if there is a character to the left, delete it
+        E.cursorX--;
+    }
+    // If the cursor is at the start of a line 
+    else {
+        editorRow *previous = editorRowAt(E.cursorY - 1);
+        E.cursorX = previous->size;
+        editorRowAppendString(previous, editorRowChars(row), row->size); // row points to the row we delete, so we append row->chars to the previous row, then delete it
+        editorDeleteRow(E.cursorY);
+        E.cursorY--;
+    }
+}
+
+/************ SNAPSHOTS ************/
+
+// Take a snapshot of the buffer. Nothing is copied: the snapshot shares the row tree, and from now on the editor
+// copies any node it changes. Snapshots that share the tree are taken and let go of on the main thread
+struct bufferSnapshot *editorSnapshotTake() {
+    editorGapFlush(); // The row in the gap buffer has to become a piece before it can be shared
+
+    struct bufferSnapshot *snapshot = malloc(sizeof(struct bufferSnapshot));
+    if (snapshot == NULL) {
+        die("malloc");
+    }
+    snapshot->references = 1;
+    snapshot->store = E.store;
+    pieceStoreRetain(E.store);
+    snapshot->rows = NULL;
+    snapshot->root = E.rows;
+    snapshot->sharesTree = 1;
+    snapshot->numRows = E.numRows;
+    snapshot->bytes = rowTreeBytes(E.rows);
+
+    // Every node there is now belongs to an older version of the tree than the nodes made from here on
+    E.treeVersion++;
+    E.sharedSnapshots++;
+    return snapshot;
+}
+
+void editorSnapshotRetain(struct bufferSnapshot *snapshot) {
+    __sync_add_and_fetch(&snapshot->references, 1);
+}
+
+// The last release frees the snapshot and lets go of its piece store. Once no snapshot shares the tree any more,
+// the nodes that were kept back for snapshots are reused
+void editorSnapshotRelease(struct bufferSnapshot *snapshot) {
+    if (snapshot == NULL || __sync_sub_and_fetch(&snapshot->references, 1) > 0) return;
+    if (snapshot->sharesTree && --E.sharedSnapshots == 0) {
+        rowNodesReclaim();
+    }
+    pieceStoreRelease(snapshot->store);
+    free(snapshot->rows);
+    free(snapshot);
+}
+
+// Walks the rows of a snapshot, one at a time in either direction. The snapshot's tree is walked down from its
+// root, since the parent and in-order links belong to the live tree, and the path down is kept to step along it
+struct snapshotCursor {
+    const struct bufferSnapshot *snapshot;
+    int64_t line; // The row the cursor is on (off the end once it is out of range)
+    rowNode **path; // The nodes from the root down to the row
+    int depth;
+    int capacity;
+};
+
+void snapshotCursorPush(struct snapshotCursor *cursor, rowNode *node) {
+    if (cursor->depth == cursor->capacity) {
+        cursor->capacity = cursor->capacity ? cursor->capacity * 2 : 64;
+        cursor->path = realloc(cursor->path, sizeof(rowNode *) * cursor->capacity);
+        if (cursor->path == NULL) {
+            die("realloc");
+        }
+    }
+    cursor->path[cursor->depth++] = node;
+}
+
+// Put a cursor on row line of a snapshot
+void snapshotSeek(struct snapshotCursor *cursor, const struct bufferSnapshot *snapshot, int64_t line) {
+    cursor->snapshot = snapshot;
+    cursor->line = line;
+    cursor->depth = 0;
+    if (snapshot->rows || line < 0 || line >= snapshot->numRows) return;
+
+    rowNode *node = snapshot->root;
+    while (node) {
+        snapshotCursorPush(cursor, node);
+        int64_t leftCount = rowTreeCount(node->left);
+        if (line < leftCount) {
+            node = node->left;
+        }
+        else if (line == leftCount) {
+            return;
+        }
+        else {
+            line -= leftCount + 1;
+            node = node->right;
+        }
+    }
+}
+
+// The piece of the row the cursor is on
+struct rowPiece snapshotRow(struct snapshotCursor *cursor) {
+    if (cursor->snapshot->rows) return cursor->snapshot->rows[cursor->line];
+    rowNode *node = cursor->path[cursor->depth - 1];
+    struct rowPiece piece = {node->row.chars, node->row.size};
+    return piece;
+}
+
+// Step to the next row, or the previous one: down the far side of the row if it has one, and otherwise back up
+// to the first node the row is on the near side of
+void snapshotStep(struct snapshotCursor *cursor, int forward) {
+    cursor->line += forward ? 1 : -1;
+    if (cursor->snapshot->rows || cursor->depth == 0) return;
+
+    rowNode *node = cursor->path[cursor->depth - 1];
+    rowNode *far = forward ? node->right : node->left;
+    if (far) {
+        for (node = far; node; node = forward ? node->left : node->right) {
+            snapshotCursorPush(cursor, node);
+        }
+        return;
+    }
+    while (cursor->depth > 1) {
+        rowNode *parent = cursor->path[cursor->depth - 2];
+        if ((forward ? parent->right : parent->left) != cursor->path[cursor->depth - 1]) break;
+        cursor->depth--;
+    }
+    cursor->depth--;
+}
+
+void snapshotNext(struct snapshotCursor *cursor) {
+    snapshotStep(cursor, 1);
+}
+
+void snapshotPrevious(struct snapshotCursor *cursor) {
+    snapshotStep(cursor, 0);
+}
+
+void snapshotCursorFree(struct snapshotCursor *cursor) {
+    free(cursor->path);
+    cursor->path = NULL;
+    cursor->capacity = 0;
+}
+
+/************ LINE SCANNING ************/
+
+// End the line being scanned just before end (carriage returns at the end of a line are not part of it)
+void lineIndexEnd(struct lineIndex *index, const char *end) {
+    const char *line = index->lineStart;
+    size_t length = end - line;
+    while (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    if (index->numLines == index->capacity) {
+        index->capacity = index->capacity ? index->capacity * 2 : 1024;
+        index->lines = realloc(index->lines, sizeof(struct rowPiece) * index->capacity);
+        if (index->lines == NULL) {
+            die("realloc");
+        }
+    }
+    index->lines[index->numLines].chars = line;
+    index->lines[index->numLines].size = length;
+    index->numLines++;
+    index->lineStart = end + 1;
+}
+
+// A byte at a time, from from up to length
+void scanNewlinesScalar(const char *buffer, size_t from, size_t length, struct lineIndex *index) {
+    size_t i;
+    for (i = from; i < length; i++) {
+        if (buffer[i] == '\n') {
+            lineIndexEnd(index, &buffer[i]);
+        }
+    }
+}
+
+#ifdef SIMPAD_X86_SIMD
+// Compare 16 bytes at a time against a newline; every set bit in the mask is a line ending
+__attribute__((target("sse2")))
+size_t scanNewlinesSSE2(const char *buffer, size_t length, struct lineIndex *index) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)&buffer[i]);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        while (mask) {
+            lineIndexEnd(index, &buffer[i + __builtin_ctz(mask)]);
+            mask &= mask - 1;
+        }
+    }
+    return i;
+}
+
+// The same with 64 bytes (two AVX2 registers) at a time
+__attribute__((target("avx2")))
+size_t scanNewlinesAVX2(const char *buffer, size_t length, struct lineIndex *index) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i;
+    for (i = 0; i + 64 <= length; i += 64) {
+        __m256i low = _mm256_loadu_si256((const __m256i *)&buffer[i]);
+        __m256i high = _mm256_loadu_si256((const __m256i *)&buffer[i + 32]);
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline)) |
+                        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+        while (mask) {
+            lineIndexEnd(index, &buffer[i + __builtin_ctzll(mask)]);
+            mask &= mask - 1;
+        }
+    }
+    return i;
+}
+#endif
+
+// Split a buffer into lines in one pass, without a library call per line. The vector scanners take whole
+// blocks, and whatever is left at the end (or the whole buffer, without SIMD) is scanned a byte at a time
+void editorScanLines(struct lineIndex *index, const char *buffer, size_t length) {
+    size_t i = 0;
+    index->lineStart = buffer;
+
+#ifdef SIMPAD_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = scanNewlinesAVX2(buffer, length, index);
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        i = scanNewlinesSSE2(buffer, length, index);
+    }
+#endif
+    scanNewlinesScalar(buffer, i, length, index);
+    // The last line may not end with a newline
+    if (index->lineStart < buffer + length) {
+        lineIndexEnd(index, buffer + length);
+    }
+}
+
+// One thread's share of a file being split into lines
+struct scanJob {
+    struct lineIndex index;
+    const char *buffer;
+    size_t length;
+    pthread_t thread;
+    int spawned;
+};
+
+void *editorScanJob(void *argument) {
+    struct scanJob *job = argument;
+    editorScanLines(&job->index, job->buffer, job->length);
+    return NULL;
+}
+
+// Split a large buffer into lines on several threads. Every share but the last ends just after a newline, so no
+// line is cut in two, and the shares' lines are joined back together in order at the end
+void editorScanLinesParallel(struct lineIndex *index, const char *buffer, size_t length) {
+    int threads = editorThreadCount();
+    if ((size_t)threads > length / SIMPAD_LOAD_CHUNK) threads = length / SIMPAD_LOAD_CHUNK;
+    if (threads <= 1) {
+        editorScanLines(index, buffer, length);
+        return;
+    }
+
+    struct scanJob *jobs = calloc(threads, sizeof(struct scanJob));
+    if (jobs == NULL) {
+        die("calloc");
+    }
+    size_t start = 0;
+    int i;
+    for (i = 0; i < threads; i++) {
+        size_t end = length;
+        if (i < threads - 1) {
+            end = length / threads * (i + 1);
+            if (end < start) end = start;
+            const char *newline = memchr(&buffer[end], '\n', length - end);
+            end = newline ? (size_t)(newline - buffer) + 1 : length;
+        }
+        jobs[i].buffer = &buffer[start];
+        jobs[i].length = end - start;
+        jobs[i].spawned = pthread_create(&jobs[i].thread, NULL, editorScanJob, &jobs[i]) == 0;
+        if (!jobs[i].spawned) editorScanJob(&jobs[i]);
+        start = end;
+    }
+
+    int64_t numLines = 0;
+    for (i = 0; i < threads; i++) {
+        if (jobs[i].spawned) pthread_join(jobs[i].thread, NULL);
+        numLines += jobs[i].index.numLines;
+    }
+    index->lines = malloc(sizeof(struct rowPiece) * (numLines ? numLines : 1));
+    if (index->lines == NULL) {
+        die("malloc");
+    }
+    for (i = 0; i < threads; i++) {
+        memcpy(&index->lines[index->numLines], jobs[i].index.lines, sizeof(struct rowPiece) * jobs[i].index.numLines);
+        index->numLines += jobs[i].index.numLines;
+        free(jobs[i].index.lines);
+    }
+    index->capacity = numLines;
+    free(jobs);
+}
+
+/************ BACKGROUND LOADING ************/
+
+// Move the lines of one index onto the end of another, leaving the first one empty
+void lineIndexMove(struct lineIndex *to, struct lineIndex *from) {
+    if (to->numLines == 0) {
+        free(to->lines);
+        *to = *from;
+    }
+    else {
+        if (to->capacity < to->numLines + from->numLines) {
+            to->capacity = to->numLines + from->numLines;
+            to->lines = realloc(to->lines, sizeof(struct rowPiece) * to->capacity);
+            if (to->lines == NULL) {
+                die("realloc");
+            }
+        }
+        memcpy(&to->lines[to->numLines], from->lines, sizeof(struct rowPiece) * from->numLines);
+        to->numLines += from->numLines;
+        free(from->lines);
+    }
+    memset(from, 0, sizeof(struct lineIndex));
+}
+
+// Scan the rest of the file a block at a time (each block ending just after a newline), handing each block's lines over
+void *editorLoaderThread(void *argument) {
+    struct fileLoader *loader = argument;
+    size_t start = loader->scanned;
+
+    while (start < loader->length) {
+        size_t end = start + SIMPAD_LOAD_BLOCK;
+        if (end >= loader->length) {
+            end = loader->length;
+        }
+        else {
+            const char *newline = memchr(&loader->buffer[end], '\n', loader->length - end);
+            end = newline ? (size_t)(newline - loader->buffer) + 1 : loader->length;
+        }
+        struct lineIndex index = {NULL, 0, 0, NULL};
+        editorScanLinesParallel(&index, &loader->buffer[start], end - start);
+
+        pthread_mutex_lock(&loader->lock);
+        lineIndexMove(&loader->ready, &index);
+        loader->scanned = end;
+        int cancel = loader->cancel;
+        pthread_mutex_unlock(&loader->lock);
+        if (cancel) break;
+        start = end;
+    }
+    return NULL;
+}
+
+// Load the rest of a buffer, from where the lines already in the editor end, in the background
+void editorLoadStart(const char *buffer, size_t scanned, size_t length) {
+    struct fileLoader *loader = &E.loader;
+    memset(&loader->ready, 0, sizeof(struct lineIndex));
+    loader->buffer = buffer;
+    loader->scanned = scanned;
+    loader->length = length;
+    loader->cancel = 0;
+    loader->percent = -1;
+    pthread_mutex_init(&loader->lock, NULL);
+    loader->active = 1;
+    loader->running = pthread_create(&loader->thread, NULL, editorLoaderThread, loader) == 0;
+    if (!loader->running) {
+        editorLoaderThread(loader); // No thread to be had, so load it all now
+    }
+}
+
+// Put the lines found so far at the end of the buffer. Returns whether there was anything to show: new lines, the
+// end of loading, or progress that shows as a different percentage
+int editorLoadPoll() {
+    struct fileLoader *loader = &E.loader;
+    if (!loader->active) return 0;
+
+    pthread_mutex_lock(&loader->lock);
+    struct lineIndex ready = loader->ready;
+    memset(&loader->ready, 0, sizeof(struct lineIndex));
+    int done = loader->scanned == loader->length;
+    int percent = loader->length ? (int)(loader->scanned * 100 / loader->length) : 100;
+    pthread_mutex_unlock(&loader->lock);
+
+    int changed = ready.numLines > 0 || done || percent != loader->percent;
+    loader->percent = percent;
+
+    if (ready.numLines > 0) {
+        size_t dirtyFrom = E.dirtyFrom; // Loading is not an edit
+        editorInsertRows(E.numRows, ready.lines, ready.numLines);
+        E.dirtyFrom = dirtyFrom;
+    }
+    free(ready.lines);
+
+    if (done) {
+        if (loader->running) pthread_join(loader->thread, NULL);
+        pthread_mutex_destroy(&loader->lock);
+        loader->running = 0;
+        loader->active = 0;
+    }
+    return changed;
+}
+
+// Wait for the whole file to be in the buffer, for anything that needs all of it (such as saving)
+void editorLoadFinish() {
+    if (!E.loader.active) return;
+    if (E.loader.running) {
+        pthread_join(E.loader.thread, NULL);
+        E.loader.running = 0;
+    }
+    editorLoadPoll();
+}
+
+// Stop loading and throw away whatever was not in the buffer yet
+void editorLoadCancel() {
+    struct fileLoader *loader = &E.loader;
+    if (!loader->active) return;
+
+    pthread_mutex_lock(&loader->lock);
+    loader->cancel = 1;
+    pthread_mutex_unlock(&loader->lock);
+    if (loader->running) pthread_join(loader->thread, NULL);
+    free(loader->ready.lines);
+    memset(&loader->ready, 0, sizeof(struct lineIndex));
+    pthread_mutex_destroy(&loader->lock);
+    loader->running = 0;
+    loader->active = 0;
+}
+
+// How much of the file has been loaded, as a percentage
+int editorLoadProgress() {
+    pthread_mutex_lock(&E.loader.lock);
+    int percent = E.loader.length ? (int)(E.loader.scanned * 100 / E.loader.length) : 100;
+    pthread_mutex_unlock(&E.loader.lock);
+    return percent;
+}
+
+/************ STREAMING INPUT ************/
+
+// Copy a run of whole lines (or, at the end of the stream, whatever is left) into a block of its own and hand
+// it over along with its lines
+void editorStreamHandOver(struct streamReader *stream, const char *bytes, size_t length) {
+    struct addBlock *block = malloc(sizeof(struct addBlock) + length);
+    if (block == NULL) {
+        die("malloc");
+    }
+    memcpy(block->data, bytes, length);
+    block->used = length;
+    block->capacity = length; // Full, so nothing typed is ever put in it
+    struct lineIndex index = {NULL, 0, 0, NULL};
+    editorScanLines(&index, block->data, length);
+
+    pthread_mutex_lock(&stream->lock);
+    block->next = stream->blocks;
+    stream->blocks = block;
+    lineIndexMove(&stream->ready, &index);
+    stream->bytes += length;
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Read the stream until it ends, handing over whole lines as soon as they arrive. A line still coming in is kept
+// back until its newline does, so the main thread only ever sees finished lines
+void *editorStreamThread(void *argument) {
+    struct streamReader *stream = argument;
+    size_t capacity = SIMPAD_STREAM_READ, used = 0;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        die("malloc");
+    }
+    int error = 0;
+
+    while (1) {
+        // Wait for something to read, looking up every so often in case the editor wants the thread to stop
+        struct pollfd readable = {stream->fd, POLLIN, 0};
+        int ready = poll(&readable, 1, 100);
+        pthread_mutex_lock(&stream->lock);
+        int cancel = stream->cancel;
+        pthread_mutex_unlock(&stream->lock);
+        if (cancel) break;
+        if (ready == 0 || (ready == -1 && errno == EINTR)) continue;
+
+        // A line longer than the buffer makes it grow
+        if (capacity - used < SIMPAD_STREAM_READ / 2) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+            if (buffer == NULL) {
+                die("realloc");
+            }
+        }
+        ssize_t bytesRead = read(stream->fd, &buffer[used], capacity - used);
+        if (bytesRead == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            error = errno;
+            bytesRead = 0; // Keep what did arrive
+        }
+        used += bytesRead;
+
+        // What was there before this read holds no newline, so only the new bytes need looking through
+        size_t length = used;
+        if (bytesRead > 0) {
+            const char *newline = memrchr(&buffer[used - bytesRead], '\n', bytesRead);
+            length = newline ? (size_t)(newline - buffer) + 1 : 0;
+        }
+        if (length > 0) {
+            editorStreamHandOver(stream, buffer, length);
+            memmove(buffer, &buffer[length], used - length);
+            used -= length;
+        }
+        if (bytesRead == 0) break;
+    }
+    free(buffer);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->done = 1;
+    stream->error = error;
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// Start reading a stream into the (empty) buffer in the background
+void editorStreamStart(int fd) {
+    struct streamReader *stream = &E.stream;
+    memset(stream, 0, sizeof(struct streamReader));
+    stream->fd = fd;
+    pthread_mutex_init(&stream->lock, NULL);
+    stream->active = 1;
+    stream->running = pthread_create(&stream->thread, NULL, editorStreamThread, stream) == 0;
+    if (!stream->running) {
+        editorStreamThread(stream); // No thread to be had, so read it all now
+    }
+}
+
+// Let go of a stream once its thread is done with it
+void editorStreamEnd() {
+    struct streamReader *stream = &E.stream;
+    if (stream->running) pthread_join(stream->thread, NULL);
+    pthread_mutex_destroy(&stream->lock);
+    close(stream->fd);
+    stream->running = 0;
+    stream->active = 0;
+}
+
+// Put the lines read so far at the end of the buffer. Until the buffer has been saved somewhere they are not an
+// edit (there is nothing they differ from), but after that they are. Returns whether there was anything to show
+int editorStreamPoll() {
+    struct streamReader *stream = &E.stream;
+    if (!stream->active) return 0;
+
+    pthread_mutex_lock(&stream->lock);
+    struct addBlock *blocks = stream->blocks;
+    struct lineIndex ready = stream->ready;
+    stream->blocks = NULL;
+    memset(&stream->ready, 0, sizeof(struct lineIndex));
+    int done = stream->done;
+    int error = stream->error;
+    pthread_mutex_unlock(&stream->lock);
+
+    while (blocks) {
+        struct addBlock *next = blocks->next;
+        addBufferAdopt(blocks);
+        blocks = next;
+    }
+    if (ready.numLines > 0) {
+        size_t dirtyFrom = E.dirtyFrom;
+        editorInsertRows(E.numRows, ready.lines, ready.numLines);
+        if (E.fileName == NULL) E.dirtyFrom = dirtyFrom;
+    }
+    free(ready.lines);
+
+    if (done) {
+        editorStreamEnd();
+        if (error) {
+            editorSetStatusMessage("Stopped reading stdin: %s", strerror(error));
+        }
+    }
+    return ready.numLines > 0 || done;
+}
+
+// Stop reading and throw away whatever was not in the buffer yet
+void editorStreamCancel() {
+    struct streamReader *stream = &E.stream;
+    if (!stream->active) return;
+
+    pthread_mutex_lock(&stream->lock);
+    stream->cancel = 1;
+    pthread_mutex_unlock(&stream->lock);
+    if (stream->running) pthread_join(stream->thread, NULL);
+    stream->running = 0;
+    while (stream->blocks) {
+        struct addBlock *next = stream->blocks->next;
+        free(stream->blocks);
+        stream->blocks = next;
+    }
+    free(stream->ready.lines);
+    memset(&stream->ready, 0, sizeof(struct lineIndex));
+    editorStreamEnd();
+}
+
+/************ WINDOWED PAGING ************/
+
+// Whether a file is too big to give every line a row. A row node is 128 bytes, so a file of short lines would need
+// several times its own size in rows; guessing 32 bytes a line, that has to fit in half the memory there is.
+// Set SIMPAD_WINDOW=on or off to decide instead
+int editorWindowWanted(size_t size) {
+    const char *mode = getenv("SIMPAD_WINDOW");
+    if (mode && !strcmp(mode, "on")) return 1;
+    if (mode && !strcmp(mode, "off")) return 0;
+
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || pageSize <= 0) return 0;
+    return (uint64_t)size / 32 * sizeof(rowNode) > (uint64_t)pages * pageSize / 2;
+}
+
+// Newlines in the original buffer from byte start up to (not including) byte end
+int64_t editorCountNewlines(size_t start, size_t end) {
+    const char *p = &E.store->orig[start];
+    const char *stop = &E.store->orig[end];
+    int64_t newlines = 0;
+    while (p < stop && (p = memchr(p, '\n', stop - p)) != NULL) {
+        newlines++;
+        p++;
+    }
+    return newlines;
+}
+
+// Lines of the original buffer from start to end (both where lines begin, or end at the end of the buffer)
+int64_t editorCountLines(size_t start, size_t end) {
+    int64_t lines = editorCountNewlines(start, end);
+    if (end == E.store->origSize && end > start && E.store->orig[end - 1] != '\n') {
+        lines++; // The last line has no newline
+    }
+    return lines;
+}
+
+// Record where every SIMPAD_CHECKPOINT_LINES-th line starts, handing them over a block at a time
+void *editorCheckpointThread(void *argument) {
+    struct lineCheckpoints *index = argument;
+    const char *buffer = index->buffer;
+    size_t position = 0;
+    int64_t lines = 0;
+
+    while (position < index->length) {
+        size_t end = index->length - position > SIMPAD_LOAD_BLOCK ? position + SIMPAD_LOAD_BLOCK : index->length;
+        size_t *found = NULL;
+        int64_t numFound = 0, capacity = 0;
+        const char *p = &buffer[position];
+        while (p < &buffer[end] && (p = memchr(p, '\n', &buffer[end] - p)) != NULL) {
+            p++;
+            lines++;
+            if (lines % SIMPAD_CHECKPOINT_LINES == 0) {
+                if (numFound == capacity) {
+                    capacity = capacity ? capacity * 2 : 256;
+                    found = realloc(found, sizeof(size_t) * capacity);
+                    if (found == NULL) {
+                        die("realloc");
+                    }
+                }
+                found[numFound++] = p - buffer;
+            }
+        }
+
+        pthread_mutex_lock(&index->lock);
+        if (index->count + numFound > index->capacity) {
+            index->capacity = (index->count + numFound) * 2;
+            index->offsets = realloc(index->offsets, sizeof(size_t) * index->capacity);
+            if (index->offsets == NULL) {
+                die("realloc");
+            }
+        }
+        if (numFound > 0) {
+            memcpy(&index->offsets[index->count], found, sizeof(size_t) * numFound);
+        }
+        index->count += numFound;
+        index->lines = lines;
+        index->scanned = end;
+        int cancel = index->cancel;
+        pthread_mutex_unlock(&index->lock);
+        free(found);
+        if (cancel) break;
+        position = end;
+    }
+    return NULL;
+}
+
+void editorCheckpointStart(const char *buffer, size_t length) {
+    struct lineCheckpoints *index = &E.window.checkpoints;
+    index->buffer = buffer;
+    index->length = length;
+    index->capacity = 1024;
+    index->offsets = malloc(sizeof(size_t) * index->capacity);
+    if (index->offsets == NULL) {
+        die("malloc");
+    }
+    index->offsets[0] = 0; // Line 0
+    index->count = 1;
+    index->scanned = 0;
+    index->lines = 0;
+    index->cancel = 0;
+    pthread_mutex_init(&index->lock, NULL);
+    index->active = 1;
+    index->running = pthread_create(&index->thread, NULL, editorCheckpointThread, index) == 0;
+    if (!index->running) {
+        editorCheckpointThread(index);
+    }
+}
+
+void editorCheckpointStop() {
+    struct lineCheckpoints *index = &E.window.checkpoints;
+    if (!index->active) return;
+
+    pthread_mutex_lock(&index->lock);
+    index->cancel = 1;
+    pthread_mutex_unlock(&index->lock);
+    if (index->running) pthread_join(index->thread, NULL);
+    pthread_mutex_destroy(&index->lock);
+    free(index->offsets);
+    index->offsets = NULL;
+    index->running = 0;
+    index->active = 0;
+}
+
+// Join the thread once it has been through the whole buffer. Returns whether the line count was still being
+// worked out, so the status bar is drawn again
+int editorCheckpointPoll() {
+    struct lineCheckpoints *index = &E.window.checkpoints;
+    if (!index->running) return 0;
+
+    pthread_mutex_lock(&index->lock);
+    int done = index->scanned == index->length;
+    pthread_mutex_unlock(&index->lock);
+    if (done) {
+        pthread_join(index->thread, NULL);
+        index->running = 0;
+    }
+    return 1;
+}
+
+// How much of the buffer has had its lines counted, as a percentage
+int editorCheckpointProgress() {
+    struct lineCheckpoints *index = &E.window.checkpoints;
+    pthread_mutex_lock(&index->lock);
+    int percent = index->length ? (int)(index->scanned * 100 / index->length) : 100;
+    pthread_mutex_unlock(&index->lock);
+    return percent;
+}
+
+// The line of the original buffer starting at offset, counted on from the nearest checkpoint before it
+// (-1 while the checkpoints have not got that far)
+int64_t editorOrigLineAt(size_t offset) {
+    struct lineCheckpoints *index = &E.window.checkpoints;
+    if (!index->active) return -1;
+
+    pthread_mutex_lock(&index->lock);
+    if (offset > index->scanned) {
+        pthread_mutex_unlock(&index->lock);
+        return -1;
+    }
+    int64_t low = 0, high = index->count - 1;
+    while (low < high) {
+        int64_t middle = low + (high - low + 1) / 2;
+        if (index->offsets[middle] <= offset) low = middle;
+        else high = middle - 1;
+    }
+    size_t checkpoint = index->offsets[low];
+    pthread_mutex_unlock(&index->lock);
+    return low * SIMPAD_CHECKPOINT_LINES + editorCountNewlines(checkpoint, offset);
+}
+
+// Lines in the whole original buffer (-1 until they have all been counted)
+int64_t editorOrigTotalLines() {
+    struct lineCheckpoints *index = &E.window.checkpoints;
+    if (!index->active) return -1;
+
+    pthread_mutex_lock(&index->lock);
+    int64_t lines = index->scanned == index->length ? index->lines : -1;
+    pthread_mutex_unlock(&index->lock);
+    if (lines >= 0 && index->length > 0 && index->buffer[index->length - 1] != '\n') {
+        lines++;
+    }
+    return lines;
+}
+
+void editorWindowAddPatch(int64_t at, size_t start, size_t end, const char *text, size_t length, int64_t lines) {
+    struct fileWindow *window = &E.window;
+    if (window->numPatches == window->patchCapacity) {
+        window->patchCapacity = window->patchCapacity ? window->patchCapacity * 2 : 16;
+        window->patches = realloc(window->patches, sizeof(struct windowPatch) * window->patchCapacity);
+        if (window->patches == NULL) {
+            die("realloc");
+        }
+    }
+    memmove(&window->patches[at + 1], &window->patches[at], sizeof(struct windowPatch) * (window->numPatches - at));
+    struct windowPatch *patch = &window->patches[at];
+    patch->start = start;
+    patch->end = end;
+    patch->text = text;
+    patch->length = length;
+    patch->lines = lines;
+    patch->origLines = editorCountLines(start, end);
+    window->numPatches++;
+}
+
+void editorWindowRemovePatch(int64_t at) {
+    struct fileWindow *window = &E.window;
+    memmove(&window->patches[at], &window->patches[at + 1], sizeof(struct windowPatch) * (window->numPatches - at - 1));
+    window->numPatches--;
+}
+
+// Byte offset of the window's first row in the file as it would be saved
+size_t editorWindowStartBytes() {
+    struct fileWindow *window = &E.window;
+    size_t bytes = window->start;
+    int64_t i;
+    for (i = 0; i < window->split; i++) {
+        bytes += window->patches[i].length - (window->patches[i].end - window->patches[i].start);
+    }
+    return bytes;
+}
+
+// Line number of the window's first row (-1 while the lines before it are still being counted)
+int64_t editorWindowFirstLine() {
+    struct fileWindow *window = &E.window;
+    int64_t line = editorOrigLineAt(window->start);
+    if (line < 0) return -1;
+    int64_t i;
+    for (i = 0; i < window->split; i++) {
+        line += window->patches[i].lines - window->patches[i].origLines;
+    }
+    return line;
+}
+
+// Lines in the whole file (-1 while they are still being counted)
+int64_t editorWindowTotalLines() {
+    struct fileWindow *window = &E.window;
+    int64_t lines = editorOrigTotalLines();
+    if (lines < 0) return -1;
+    int64_t i;
+    for (i = 0; i < window->numPatches; i++) {
+        lines += window->patches[i].lines - window->patches[i].origLines;
+    }
+    return lines + E.numRows - window->origLines;
+}
+
+int editorWindowMoreAbove() {
+    return E.window.start > 0 || E.window.split > 0;
+}
+
+int editorWindowMoreBelow() {
+    return E.window.end < E.store->origSize || E.window.split < E.window.numPatches;
+}
+
+// Put lines into the tree at row at. Paging is not an edit, so the file stays as clean as it was. Nodes freed by
+// paging out are used up first, one row at a time (a block has to be new nodes side by side)
+void editorWindowInsertRows(int64_t at, const struct rowPiece *lines, int64_t n) {
+    size_t dirtyFrom = E.dirtyFrom;
+    int64_t i;
+    for (i = 0; i < n && E.freeRows; i++) {
+        editorInsertRows(at + i, &lines[i], 1);
+    }
+    if (i < n) {
+        editorInsertRows(at + i, &lines[i], n - i);
+    }
+    E.dirtyFrom = dirtyFrom;
+}
+
+// Page up to n lines in below the window: lines of the original buffer, or a patch's lines in place of the bytes it
+// replaces. Returns how many came in
+int64_t editorWindowLoadBelow(int64_t n) {
+    struct fileWindow *window = &E.window;
+    const char *orig = E.store->orig;
+    struct lineIndex index = {NULL, 0, 0, NULL};
+
+    while (index.numLines < n) {
+        if (window->split < window->numPatches && window->patches[window->split].start == window->end) {
+            struct windowPatch *patch = &window->patches[window->split];
+            editorScanLines(&index, patch->text, patch->length);
+            window->end = patch->end;
+            window->origLines += patch->origLines;
+            editorWindowRemovePatch(window->split);
+            continue;
+        }
+        size_t limit = window->split < window->numPatches ? window->patches[window->split].start : E.store->origSize;
+        if (window->end >= limit) break;
+
+        // Whole lines up to the next patch
+        const char *p = &orig[window->end];
+        int64_t before = index.numLines;
+        index.lineStart = p;
+        while (index.numLines < n && p < &orig[limit]) {
+            const char *newline = memchr(p, '\n', &orig[limit] - p);
+            lineIndexEnd(&index, newline ? newline : &orig[limit]);
+            p = newline ? newline + 1 : &orig[limit];
+        }
+        window->origLines += index.numLines - before;
+        window->end = p - orig;
+    }
+    editorWindowInsertRows(E.numRows, index.lines, index.numLines);
+    free(index.lines);
+    window->generation++;
+    return index.numLines;
+}
+
+// Page up to n lines in above the window (a patch comes in whole). The rows on screen move down by as many
+int64_t editorWindowLoadAbove(int64_t n) {
+    struct fileWindow *window = &E.window;
+    const char *orig = E.store->orig;
+    int64_t loaded = 0;
+
+    while (loaded < n) {
+        struct lineIndex index = {NULL, 0, 0, NULL};
+        if (window->split > 0 && window->patches[window->split - 1].end == window->start) {
+            struct windowPatch *patch = &window->patches[window->split - 1];
+            editorScanLines(&index, patch->text, patch->length);
+            window->start = patch->start;
+            window->origLines += patch->origLines;
+            window->split--;
+            editorWindowRemovePatch(window->split);
+        }
+        else {
+            size_t limit = window->split > 0 ? window->patches[window->split - 1].end : 0;
+            if (window->start <= limit) break;
+
+            // Walk back over whole lines, as far as the patch before
+            size_t from = window->start;
+            int64_t lines = 0;
+            while (lines < n - loaded && from > limit) {
+                const char *newline = memrchr(&orig[limit], '\n', from - 1 - limit);
+                from = newline ? (size_t)(newline - orig) + 1 : limit;
+                lines++;
+            }
+            editorScanLines(&index, &orig[from], window->start - from);
+            window->start = from;
+            window->origLines += index.numLines;
+        }
+        editorWindowInsertRows(0, index.lines, index.numLines);
+        free(index.lines);
+        loaded += index.numLines;
+    }
+    E.cursorY += loaded;
+    E.rowOffset += loaded;
+    window->shift += loaded;
+    window->generation++;
+    return loaded;
+}
+
+// Where the line a row holds ends in the original buffer (just past its newline) if the row is still exactly that
+// whole line, or 0 if it is not. Only such rows are known to stand where they were in the file
+size_t editorRowOrigEnd(editorRow *row) {
+    const char *orig = E.store->orig;
+    size_t origSize = E.store->origSize;
+    if (row == E.gap.row || row->chars < orig || row->chars + row->size > orig + origSize || origSize == 0) return 0;
+
+    size_t start = row->chars - orig;
+    if (start > 0 && orig[start - 1] != '\n') return 0;
+    size_t end = start + row->size;
+    while (end < origSize && orig[end] == '\r') {
+        end++;
+    }
+    if (end == origSize) return end;
+    return orig[end] == '\n' ? end + 1 : 0;
+}
+
+// Copy n rows (from row on) out as a patch for the original bytes from start to end, at patch index at
+void editorWindowPatchRows(int64_t at, size_t start, size_t end, editorRow *row, int64_t n) {
+    size_t length = 0;
+    editorRow *current;
+    int64_t i;
+    for (current = row, i = 0; i < n; current = editorRowNext(current), i++) {
+        length += current->size + 1;
+    }
+    char *text = length ? addBufferReserve(length) : NULL;
+    size_t used = 0;
+    for (current = row, i = 0; i < n; current = editorRowNext(current), i++) {
+        memcpy(&text[used], current->chars, current->size);
+        used += current->size;
+        text[used++] = '\n';
+    }
+    editorWindowAddPatch(at, start, end, text, length, n);
+}
+
+// Turn rows first up to last, which stand for the original bytes from start to end, into patches from patch index
+// at on. Rows that are still whole original lines in their place are left to the original buffer, so only what was
+// edited (or deleted) takes up memory. Returns how many patches were made
+int64_t editorWindowFold(int64_t first, int64_t last, size_t start, size_t end, int64_t at) {
+    size_t position = start; // Where the original bytes are up to
+    editorRow *changed = NULL; // First row since then that is not one of them
+    int64_t changedAt = 0, made = 0, i;
+    editorRow *row = first < last ? editorRowAt(first) : NULL;
+
+    for (i = first; i < last; i++, row = editorRowNext(row)) {
+        size_t rowEnd = editorRowOrigEnd(row);
+        size_t rowStart = row->chars - E.store->orig;
+        if (rowEnd && rowStart >= position && rowEnd <= end) {
+            if (changed || rowStart > position) {
+                editorWindowPatchRows(at + made++, position, rowStart, changed, changed ? i - changedAt : 0);
+            }
+            changed = NULL;
+            position = rowEnd;
+        }
+        else if (changed == NULL) {
+            changed = row;
+            changedAt = i;
+        }
+    }
+    if (changed || position < end) {
+        editorWindowPatchRows(at + made++, position, end, changed, changed ? last - changedAt : 0);
+    }
+    return made;
+}
+
+// Take rows first up to last out of the tree (their text stays where it is)
+void editorWindowDropRows(int64_t first, int64_t last) {
+    if (first >= last) return;
+
+    rowNode *before, *middle, *after;
+    rowTreeSplit(E.rows, first, &before, &middle);
+    rowTreeSplit(middle, last - first, &middle, &after);
+    rowNode *above = rowTreeLast(before);
+    rowNode *below = rowTreeFirst(after);
+    if (above) above->next = below;
+    if (below) below->previous = above;
+
+    rowNode *node = rowTreeFirst(middle);
+    int64_t i;
+    for (i = first; i < last; i++) {
+        rowNode *next = node->next;
+        if (E.gap.row == &node->row) E.gap.row = NULL;
+        editorFreeRow(&node->row);
+        rowNodeFree(node);
+        node = next;
+    }
+    E.rows = rowTreeMerge(before, after);
+    if (E.rows) E.rows->parent = NULL;
+    E.numRows -= last - first;
+}
+
+// Page out the rows above row limit, or as many of them as can go: the window has to start at a row that is still a
+// whole original line, since that is where it then starts in the original buffer. Returns how many went
+int64_t editorWindowDropAbove(int64_t limit) {
+    struct fileWindow *window = &E.window;
+    editorGapFlush();
+    int64_t first = limit;
+    editorRow *row = editorRowAt(first);
+    while (first > 0 && !editorRowOrigEnd(row)) {
+        row = editorRowPrevious(row);
+        first--;
+    }
+    if (first == 0) return 0;
+
+    size_t boundary = row->chars - E.store->orig;
+    window->origLines -= editorCountLines(window->start, boundary);
+    window->split += editorWindowFold(0, first, window->start, boundary, window->split);
+    editorWindowDropRows(0, first);
+    window->start = boundary;
+
+    E.cursorY -= first;
+    E.rowOffset -= first;
+    window->shift -= first;
+    window->generation++;
+    return first;
+}
+
+// Page out the rows from row limit down, from the first of them that is still a whole original line
+int64_t editorWindowDropBelow(int64_t limit) {
+    struct fileWindow *window = &E.window;
+    editorGapFlush();
+    int64_t first = limit;
+    editorRow *row = editorRowAt(first);
+    while (row && !editorRowOrigEnd(row)) {
+        row = editorRowNext(row);
+        first++;
+    }
+    if (row == NULL) return 0;
+
+    size_t boundary = row->chars - E.store->orig;
+    int64_t dropped = E.numRows - first;
+    window->origLines -= editorCountLines(boundary, window->end);
+    editorWindowFold(first, E.numRows, boundary, window->end, window->split);
+    editorWindowDropRows(first, E.numRows);
+    window->end = boundary;
+    window->generation++;
+    return dropped;
+}
+
+// Keep the window around the screen as it scrolls: page rows in before the screen gets near either end of the
+// window, and once it holds more than SIMPAD_WINDOW_ROWS, page out the side further from the screen
+void editorWindowScroll() {
+    if (!E.window.active) return;
+
+    while (E.rowOffset < SIMPAD_WINDOW_MARGIN && editorWindowMoreAbove()) {
+        editorWindowLoadAbove(SIMPAD_WINDOW_PAGE);
+    }
+    while (E.numRows - E.rowOffset - E.termRows < SIMPAD_WINDOW_MARGIN && editorWindowMoreBelow()) {
+        editorWindowLoadBelow(SIMPAD_WINDOW_PAGE);
+    }
+    if (E.numRows > SIMPAD_WINDOW_ROWS) {
+        int64_t above = E.rowOffset - SIMPAD_WINDOW_ROWS / 4; // Rows above this one can go...
+        int64_t below = E.rowOffset + E.termRows + SIMPAD_WINDOW_ROWS / 4; // ...and so can rows from this one on
+        if (above > E.numRows - below) {
+            editorWindowDropAbove(above);
+        }
+        else if (below < E.numRows) {
+            editorWindowDropBelow(below);
+        }
+    }
+}
+
+// The file outside the window as runs of bytes in file order, original bytes and patches' lines.
+// *windowAt is how many of them come before the window
+struct windowPart *editorWindowParts(int64_t *count, int64_t *windowAt) {
+    struct fileWindow *window = &E.window;
+    struct windowPart *parts = malloc(sizeof(struct windowPart) * (2 * window->numPatches + 2));
+    if (parts == NULL) {
+        die("malloc");
+    }
+    const char *orig = E.store->orig;
+    size_t position = 0;
+    int64_t n = 0, i;
+
+    for (i = 0; i <= window->numPatches; i++) {
+        if (i == window->split) {
+            if (window->start > position) {
+                parts[n].text = &orig[position];
+                parts[n++].length = window->start - position;
+            }
+            *windowAt = n;
+            position = window->end;
+        }
+        if (i == window->numPatches) break;
+
+        struct windowPatch *patch = &window->patches[i];
+        if (patch->start > position) {
+            parts[n].text = &orig[position];
+            parts[n++].length = patch->start - position;
+        }
+        if (patch->length > 0) {
+            parts[n].text = patch->text;
+            parts[n++].length = patch->length;
+        }
+        position = patch->end;
+    }
+    if (E.store->origSize > position) {
+        parts[n].text = &orig[position];
+        parts[n++].length = E.store->origSize - position;
+    }
+    *count = n;
+    return parts;
+}
+
+// Snapshot the whole file in windowed mode, without a piece per line: each part outside the window is one piece
+// however many lines it holds (ending just before its last newline, which the writer puts back), and the window
+// adds its rows. Stretches of the original file come out as long runs of it, ready to be copied by the kernel
+struct bufferSnapshot *editorWindowSnapshot() {
+    editorGapFlush();
+    int64_t count, windowAt, i, n = 0;
+    struct windowPart *parts = editorWindowParts(&count, &windowAt);
+    struct bufferSnapshot *snapshot = malloc(sizeof(struct bufferSnapshot));
+    struct rowPiece *rows = malloc(sizeof(struct rowPiece) * (count + E.numRows + 1));
+    if (snapshot == NULL || rows == NULL) {
+        die("malloc");
+    }
+
+    size_t bytes = 0;
+    for (i = 0; i <= count; i++) {
+        if (i == windowAt) {
+            editorRow *row;
+            for (row = editorRowAt(0); row; row = editorRowNext(row)) {
+                rows[n].chars = row->chars;
+                rows[n++].size = row->size;
+            }
+            bytes += rowTreeBytes(E.rows);
+        }
+        if (i == count) break;
+
+        int newline = parts[i].text[parts[i].length - 1] == '\n'; // Only the end of the file may be missing one
+        rows[n].chars = parts[i].text;
+        rows[n].size = parts[i].length - newline;
+        bytes += rows[n++].size + 1;
+    }
+    free(parts);
+
+    snapshot->references = 1;
+    snapshot->store = E.store;
+    pieceStoreRetain(E.store);
+    snapshot->rows = rows;
+    snapshot->root = NULL;
+    snapshot->sharesTree = 0;
+    snapshot->numRows = n;
+    snapshot->bytes = bytes;
+    return snapshot;
+}
+
+// Move the window to the byte offset of the file (as it would be saved), with the cursor on it
+void editorWindowJump(size_t offset) {
+    struct fileWindow *window = &E.window;
+
+    // Fold the whole window away, leaving the file as original bytes and patches
+    editorGapFlush();
+    editorWindowFold(0, E.numRows, window->start, window->end, window->split);
+    editorWindowDropRows(0, E.numRows);
+
+    // Find the original bytes or the patch the offset falls in
+    size_t position = 0, bytes = 0; // Original bytes and bytes of the file up to the gap being looked at
+    int64_t i;
+    int inPatch = 0;
+    for (i = 0; i < window->numPatches; i++) {
+        struct windowPatch *patch = &window->patches[i];
+        if (offset < bytes + (patch->start - position)) break;
+        bytes += patch->start - position;
+        if (offset < bytes + patch->length) {
+            inPatch = 1;
+            break;
+        }
+        bytes += patch->length;
+        position = patch->end;
+    }
+
+    size_t column = 0;
+    if (inPatch) {
+        window->start = window->patches[i].start;
+        column = offset - bytes;
+    }
+    else {
+        // The start of the line the offset is on, no further back than the gap goes
+        size_t limit = i < window->numPatches ? window->patches[i].start : E.store->origSize;
+        size_t target = position + (offset - bytes);
+        if (target > limit) target = limit;
+        const char *newline = memrchr(&E.store->orig[position], '\n', target - position);
+        window->start = newline ? (size_t)(newline - E.store->orig) + 1 : position;
+        column = target - window->start;
+    }
+    window->end = window->start;
+    window->split = i;
+    window->origLines = 0;
+    window->jumps++;
+
+    editorWindowLoadBelow(SIMPAD_WINDOW_PAGE);
+    E.cursorY = editorLineAtOffset(column, &column);
+    E.cursorX = column;
+    if (E.cursorY < E.numRows && E.cursorX > editorRowAt(E.cursorY)->size) {
+        E.cursorX = editorRowAt(E.cursorY)->size; // It was on a carriage return
+    }
+    E.rowOffset = E.cursorY;
+    editorWindowLoadAbove(SIMPAD_WINDOW_PAGE);
+}
+
+// The last place needle appears in haystack (memmem only finds the first). It looks a megabyte at a time from the
+// end, so a match near the end of a huge stretch is found without going through the whole of it
+const char *editorFindLast(const char *haystack, size_t length, const char *needle, size_t needleLength) {
+    const size_t chunk = 1024 * 1024;
+    size_t end = length;
+    while (end >= needleLength && end > 0) {
+        size_t start = end > chunk + needleLength ? end - chunk - needleLength : 0;
+        const char *last = NULL;
+        const char *p = &haystack[start];
+        while ((p = memmem(p, &haystack[end] - p, needle, needleLength)) != NULL) {
+            last = p++;
+        }
+        if (last || start == 0) return last;
+        end = start + needleLength - 1; // The next chunk takes in a match straddling this one's start
+    }
+    return NULL;
+}
+
+// Search the file outside the window, from the window on in the direction given and round to it again. A match
+// moves the window there, with the cursor on it. Returns whether there was one
+int editorWindowFind(const char *query, int direction) {
+    int64_t count, windowAt, i, step;
+    struct windowPart *parts = editorWindowParts(&count, &windowAt);
+    size_t queryLength = strlen(query);
+
+    // Byte offset where each part starts, as if the window were not there
+    size_t *starts = malloc(sizeof(size_t) * (count + 1));
+    if (starts == NULL) {
+        die("malloc");
+    }
+    size_t bytes = 0;
+    for (i = 0; i < count; i++) {
+        if (i == windowAt) bytes += rowTreeBytes(E.rows);
+        starts[i] = bytes;
+        bytes += parts[i].length;
+    }
+
+    int found = 0;
+    size_t offset = 0;
+    i = direction == 1 ? windowAt : windowAt - 1;
+    for (step = 0; step < count; step++, i += direction) {
+        if (i == count) i = 0;
+        if (i == -1) i = count - 1;
+        const char *match = direction == 1 ? memmem(parts[i].text, parts[i].length, query, queryLength)
+                                           : editorFindLast(parts[i].text, parts[i].length, query, queryLength);
+        if (match) {
+            offset = starts[i] + (match - parts[i].text);
+            found = 1;
+            break;
+        }
+    }
+    free(starts);
+    free(parts);
+    if (found) {
+        editorWindowJump(offset);
+    }
+    return found;
+}
+
+// Start a file in windowed mode: counting its lines starts on its own thread, and only its first page is laid out
+void editorWindowOpen() {
+    struct fileWindow *window = &E.window;
+    window->active = 1;
+    window->start = 0;
+    window->end = 0;
+    window->origLines = 0;
+    window->numPatches = 0;
+    window->split = 0;
+    editorCheckpointStart(E.store->orig, E.store->origSize);
+    editorWindowLoadBelow(SIMPAD_WINDOW_PAGE);
+}
+
+void editorWindowClose() {
+    editorCheckpointStop();
+    free(E.window.patches);
+    memset(&E.window, 0, sizeof(struct fileWindow));
+}
+
+/************ FOLLOW MODE ************/
+
+// Stop watching the file
+void editorFollowStop() {
+    struct fileFollower *follow = &E.follow;
+    if (follow->inotify != -1) close(follow->inotify);
+    if (follow->fd != -1) close(follow->fd);
+    follow->inotify = -1;
+    follow->fd = -1;
+    follow->active = 0;
+}
+
+// Watch a file the buffer holds the first offset bytes of, to pick up whatever is appended to it from there on
+void editorFollowStart(const char *path, size_t offset, int partial) {
+    struct fileFollower *follow = &E.follow;
+    editorFollowStop();
+#ifdef SIMPAD_INOTIFY
+    follow->fd = open(path, O_RDONLY);
+    follow->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow->fd == -1 || follow->inotify == -1 ||
+        inotify_add_watch(follow->inotify, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+        editorSetStatusMessage("Can't follow %s: %s", path, strerror(errno));
+        editorFollowStop();
+        return;
+    }
+    follow->offset = offset;
+    follow->partial = partial;
+    follow->active = 1;
+#else
+    (void)path;
+    (void)offset;
+    (void)partial;
+    editorSetStatusMessage("Follow mode needs inotify");
+#endif
+}
+
+// Whether the screen should stay at the bottom: the cursor is on the last row, or still on the row follow mode
+// last put it on (rows loaded in since then have pushed the bottom further down)
+int editorFollowPinned() {
+    return E.cursorY >= E.numRows - 1 || (E.follow.pinned && E.cursorY == E.follow.pinnedRow);
+}
+
+void editorFollowPin() {
+    int64_t last = E.numRows > 0 ? E.numRows - 1 : 0;
+    if (E.cursorY != last) {
+        E.cursorY = last;
+        E.cursorX = 0;
+    }
+    E.follow.pinned = 1;
+    E.follow.pinnedRow = E.cursorY;
+}
+
+// Read what was appended to the file since the last time and put it at the end of the buffer. Only the new
+// bytes are read, and the rows already there are left alone (only the last one, if it had no newline yet, is
+// continued). Returns whether any rows changed
+int editorFollowAppend(size_t size) {
+    struct fileFollower *follow = &E.follow;
+    size_t length = size - follow->offset;
+    struct addBlock *block = malloc(sizeof(struct addBlock) + length);
+    if (block == NULL) {
+        die("malloc");
+    }
+    ssize_t bytesRead = ioReadSync(follow->fd, block->data, length, follow->offset);
+    if (bytesRead <= 0) {
+        free(block);
+        return 0;
+    }
+    block->used = bytesRead;
+    addBufferAdopt(block);
+    follow->offset += bytesRead;
+
+    struct lineIndex index = {NULL, 0, 0, NULL};
+    editorScanLines(&index, block->data, bytesRead);
+    size_t dirtyFrom = E.dirtyFrom; // The file already has these bytes, so they are not an edit
+    int64_t first = 0;
+    if (follow->partial && E.numRows > 0) {
+        editorRowAppendString(editorRowAt(E.numRows - 1), index.lines[0].chars, index.lines[0].size);
+        first = 1;
+    }
+    editorInsertRows(E.numRows, &index.lines[first], index.numLines - first);
+    E.dirtyFrom = dirtyFrom;
+    follow->partial = block->data[bytesRead - 1] != '\n';
+    free(index.lines);
+    return 1;
+}
+
+// The file was cut short or replaced (say, by log rotation): start over from the file now at its path, unless
+// that would lose edits
+void editorFollowReopen(const char *reason) {
+    if (editorIsDirty()) {
+        editorFollowStop();
+        editorSetStatusMessage("%s, stopped following (the buffer has unsaved changes)", reason);
+        return;
+    }
+    char *path = strdup(E.fileName);
+    editorOpen(path);
+    free(path);
+    editorFollowPin();
+    editorSetStatusMessage("%s, reloaded", reason);
+}
+
+// Called while waiting for a key: take in whatever inotify says happened to the file, and keep the screen at the
+// bottom if that is where it was. Returns whether anything changed that should be drawn
+int editorFollowPoll() {
+    struct fileFollower *follow = &E.follow;
+    // Appends go after the rows still being loaded, and a save writing to the file must not be read back as one
+    if (!follow->active || E.loader.active || E.save.active) return 0;
+
+    int pinned = editorFollowPinned();
+    int changed = 0;
+#ifdef SIMPAD_INOTIFY
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint32_t mask = 0;
+    ssize_t length;
+    while ((length = read(follow->inotify, events, sizeof(events))) > 0) {
+        ssize_t at;
+        for (at = 0; at < length; at += sizeof(struct inotify_event) + ((struct inotify_event *)&events[at])->len) {
+            mask |= ((struct inotify_event *)&events[at])->mask;
+        }
+    }
+    if (mask) {
+        struct stat fileStat, pathStat;
+        if (fstat(follow->fd, &fileStat) == -1) {
+            return 0;
+        }
+        if ((size_t)fileStat.st_size < follow->offset) {
+            editorFollowReopen("File truncated");
+            return 1;
+        }
+        if ((size_t)fileStat.st_size > follow->offset) {
+            changed = editorFollowAppend(fileStat.st_size);
+        }
+        // Once the file has been moved away (anything written to it before then has been read by now), a new
+        // one at its path takes over. Until one turns up the old one is followed, since it may still be written to
+        if ((mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)) && stat(E.fileName, &pathStat) == 0 &&
+            (pathStat.st_ino != fileStat.st_ino || pathStat.st_dev != fileStat.st_dev)) {
+            editorFollowReopen("File replaced");
+            return 1;
+        }
+    }
+#endif
+    if (pinned && (changed || E.cursorY != (E.numRows > 0 ? E.numRows - 1 : 0))) {
+        editorFollowPin();
+        changed = 1;
+    }
+    else if (!pinned) {
+        E.follow.pinned = 0;
+    }
+    return changed;
+}
+
+/************ CHANGE DETECTION ************/
+
+// Whether two stats are of the same file with the same contents, as far as its size and modification time can tell
+int editorSameFile(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size && a->st_mtime == b->st_mtime
+#ifdef __linux__
+           && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+#endif
+           ;
+}
+
+// A quick 64-bit hash of a block of bytes, a word at a time
+uint64_t editorHash(const char *bytes, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+    size_t i;
+    for (i = 0; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, &bytes[i], 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (unsigned char)bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Hash whole blocks of the file from start on, a batch of them per read, into hashes (back to front if backward).
+// Returns 0 if it was cut short
+int editorHashPass(struct blockHashes *hashes, char *buffer, off_t start, uint64_t *into, int backward) {
+    size_t k = 0, j;
+    while (k < hashes->blocks) {
+        size_t count = hashes->blocks - k < SIMPAD_HASH_BATCH ? hashes->blocks - k : SIMPAD_HASH_BATCH;
+        if (ioReadSync(hashes->fd, buffer, count * SIMPAD_HASH_BLOCK, start + k * SIMPAD_HASH_BLOCK) != (ssize_t)(count * SIMPAD_HASH_BLOCK)) {
+            return 0;
+        }
+        for (j = 0; j < count; j++) {
+            uint64_t hash = editorHash(&buffer[j * SIMPAD_HASH_BLOCK], SIMPAD_HASH_BLOCK);
+            into[backward ? hashes->blocks - 1 - (k + j) : k + j] = hash;
+        }
+        k += count;
+
+        pthread_mutex_lock(&hashes->lock);
+        int cancel = hashes->cancel;
+        pthread_mutex_unlock(&hashes->lock);
+        if (cancel) return 0;
+    }
+    return 1;
+}
+
+// Hash every whole block of the file, counting both from the start and back from the end. The file is read rather
+// than its mapping, so that being cut short underneath the thread is an error and not a fault. The hashes are only
+// kept if the file is still as it was loaded when they are done
+void *editorHashThread(void *argument) {
+    struct blockHashes *hashes = argument;
+    struct pieceStore *store = hashes->store;
+    char *buffer = malloc(SIMPAD_HASH_BLOCK * SIMPAD_HASH_BATCH);
+    if (buffer == NULL) {
+        die("malloc");
+    }
+    struct stat fileStat;
+    hashes->valid = editorHashPass(hashes, buffer, 0, hashes->forward, 0) &&
+                    editorHashPass(hashes, buffer, store->origSize - hashes->blocks * SIMPAD_HASH_BLOCK, hashes->backward, 1) &&
+                    fstat(hashes->fd, &fileStat) == 0 && editorSameFile(&fileStat, &store->origStat);
+    free(buffer);
+    return NULL;
+}
+
+// Throw the hashes away (stopping the thread if it is still at it)
+void editorHashStop() {
+    struct blockHashes *hashes = &E.watch.hashes;
+    if (hashes->store == NULL) return;
+
+    pthread_mutex_lock(&hashes->lock);
+    hashes->cancel = 1;
+    pthread_mutex_unlock(&hashes->lock);
+    if (hashes->running) pthread_join(hashes->thread, NULL);
+    pthread_mutex_destroy(&hashes->lock);
+    if (hashes->fd != -1) close(hashes->fd);
+    free(hashes->forward);
+    free(hashes->backward);
+    pieceStoreRelease(hashes->store);
+    memset(hashes, 0, sizeof(struct blockHashes));
+}
+
+// Hash the buffer's original file, at path, in the background
+void editorHashStart(const char *path) {
+    struct blockHashes *hashes = &E.watch.hashes;
+    editorHashStop();
+
+    hashes->store = E.store;
+    pieceStoreRetain(hashes->store);
+    hashes->blocks = hashes->store->origSize / SIMPAD_HASH_BLOCK;
+    hashes->forward = malloc(sizeof(uint64_t) * (hashes->blocks + 1));
+    hashes->backward = malloc(sizeof(uint64_t) * (hashes->blocks + 1));
+    if (hashes->forward == NULL || hashes->backward == NULL) {
+        die("malloc");
+    }
+    pthread_mutex_init(&hashes->lock, NULL);
+    hashes->fd = open(path, O_RDONLY);
+    if (hashes->fd == -1) return; // Never valid, so a change reloads the whole file
+    hashes->running = pthread_create(&hashes->thread, NULL, editorHashThread, hashes) == 0;
+    if (!hashes->running) {
+        editorHashThread(hashes);
+    }
+}
+
+void editorWatchStop() {
+    struct fileWatch *watch = &E.watch;
+    editorHashStop();
+    if (watch->inotify != -1) close(watch->inotify);
+    free(watch->name);
+    watch->inotify = -1;
+    watch->name = NULL;
+    watch->pending = 0;
+    watch->changed = 0;
+    watch->overwrite = 0;
+}
+
+// Watch the directory a file is in for anything done to the file: written in place, or replaced by another file
+// renamed over it (as most editors save). Watching the file itself would miss the second
+void editorWatchStart(const char *path) {
+    struct fileWatch *watch = &E.watch;
+    editorWatchStop();
+#ifdef SIMPAD_INOTIFY
+    char *directory = realpath(path, NULL);
+    if (directory == NULL) return;
+    char *slash = strrchr(directory, '/');
+    watch->name = strdup(slash + 1);
+    slash[slash == directory] = '\0'; // Keep the slash of the root directory
+    watch->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->inotify == -1 || inotify_add_watch(watch->inotify, directory,
+            IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_MOVED_TO | IN_DELETE) == -1) {
+        free(directory);
+        editorWatchStop();
+        return;
+    }
+    free(directory);
+    watch->known = E.store->origStat;
+    editorHashStart(path);
+#else
+    (void)path;
+#endif
+}
+
+// Point a row at the same characters somewhere else
+void editorRowRepoint(editorRow *row, const char *chars) {
+    if (row->render == row->chars) row->render = chars;
+    row->chars = chars;
+}
+
+// Point a row that is in the original buffer at the same bytes, moved by distance, in another store. Returns 0
+// if the row is not in the original buffer after all
+int editorRowMove(editorRow *row, struct pieceStore *store, int64_t distance) {
+    if (row->chars < E.store->orig || row->chars > E.store->orig + E.store->origSize) return 0;
+    editorRowRepoint(row, store->orig + (row->chars - E.store->orig) + distance);
+    return 1;
+}
+
+// The file a mapping was made of is being changed in place, so pages of it may change or go away under any row
+// still pointing into it. Copy those rows to the add buffer, where they stay as they were. In windowed mode that
+// can only be done for the rows that are paged in
+void editorDetachRows(const struct stat *fileStat) {
+    struct pieceStore *store = E.store;
+    if (!store->mapped || fileStat->st_dev != store->origStat.st_dev || fileStat->st_ino != store->origStat.st_ino) {
+        return; // A file replaced by another one leaves the mapped version as it was
+    }
+    editorRow *row;
+    for (row = editorRowAt(0); row; row = editorRowNext(row)) {
+        if (row != E.gap.row && row->chars >= store->orig && row->chars < store->orig + store->origSize) {
+            char *chars = addBufferReserve(row->size);
+            memcpy(chars, row->chars, row->size);
+            editorRowRepoint(row, chars);
+        }
+    }
+}
+
+// Whether a row holds exactly the characters of a line
+int editorRowIs(editorRow *row, const struct rowPiece *line) {
+    return row->size == line->size && memcmp(row->chars, line->chars, line->size) == 0;
+}
+
+// How many rows start at or before a byte of the original buffer, or -1 if a row turns out to be somewhere else
+int64_t editorRowsStartingBy(size_t offset) {
+    const char *orig = E.store->orig;
+    int64_t low = 0, high = E.numRows;
+    while (low < high) {
+        int64_t middle = low + (high - low) / 2;
+        const char *chars = editorRowAt(middle)->chars;
+        if (chars < orig || chars > orig + E.store->origSize) return -1;
+        if ((size_t)(chars - orig) <= offset) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Bring the rows up to date with a new version of the file, replacing only the lines that differ. The blocks at
+// either end whose hashes have not changed are taken as they were; the rows there keep everything but where they
+// point, and the lines between them are the only ones laid out anew. Returns 0 (having changed nothing but perhaps
+// where rows point) if the rows are not all in the original buffer, which a clean buffer's should be
+int editorReloadRows(struct pieceStore *store) {
+    struct blockHashes *hashes = &E.watch.hashes;
+    const char *orig = E.store->orig;
+    size_t oldSize = E.store->origSize, newSize = store->origSize;
+    size_t common = oldSize < newSize ? oldSize : newSize;
+    if (hashes->store != E.store || !hashes->valid) return 0;
+    E.gap.row = NULL; // A clean row in the gap buffer says the same as its piece
+
+    // Whole blocks that are the same at the start of the file, and then at the end
+    size_t prefix = 0, suffix = 0, k;
+    for (k = 0; prefix + SIMPAD_HASH_BLOCK <= common; k++, prefix += SIMPAD_HASH_BLOCK) {
+        if (editorHash(&store->orig[prefix], SIMPAD_HASH_BLOCK) != hashes->forward[k]) break;
+    }
+    for (k = 0; prefix + suffix + SIMPAD_HASH_BLOCK <= common; k++, suffix += SIMPAD_HASH_BLOCK) {
+        if (editorHash(&store->orig[newSize - suffix - SIMPAD_HASH_BLOCK], SIMPAD_HASH_BLOCK) != hashes->backward[k]) break;
+    }
+
+    // A file replaced by another one (rather than written over) leaves the old version intact in memory, so there
+    // the change can be narrowed down to the byte
+    int intact = !E.store->mapped || E.store->origStat.st_ino != store->origStat.st_ino || E.store->origStat.st_dev != store->origStat.st_dev;
+    if (intact) {
+        while (prefix + suffix < common && orig[prefix] == store->orig[prefix]) prefix++;
+        while (prefix + suffix < common && orig[oldSize - suffix - 1] == store->orig[newSize - suffix - 1]) suffix++;
+    }
+
+    // The rows from the one the change starts in, up to (not including) the first one that starts after the
+    // change ends, since the line the change ends in carries on into the unchanged bytes. Bytes after the last row
+    // (its newline) are in no row, so a change starting there starts after it. A change made of whole lines is
+    // then just those lines
+    size_t changeEnd = oldSize - suffix, newChangeEnd = newSize - suffix;
+    int64_t first = editorRowsStartingBy(prefix) - 1;
+    int64_t last = editorRowsStartingBy(changeEnd);
+    int64_t lastBefore = changeEnd > 0 ? editorRowsStartingBy(changeEnd - 1) : 0;
+    if (first < -1 || last < 0 || lastBefore < 0) return 0;
+    if (first < 0) first = 0;
+    // Unless the line the change ends in is one that starts right there, in both versions, so it is untouched
+    if (lastBefore == last - 1 && last - 1 >= first && (newChangeEnd == 0 || store->orig[newChangeEnd - 1] == '\n')) {
+        last--;
+    }
+    if (first == E.numRows - 1 && prefix == oldSize) {
+        editorRow *row = editorRowAt(first);
+        if ((size_t)(row->chars - orig) + row->size < oldSize) first = E.numRows;
+    }
+    size_t start = first < E.numRows ? (size_t)(editorRowAt(first)->chars - orig) : oldSize;
+    size_t end = last < E.numRows ? (size_t)(editorRowAt(last)->chars - orig) : oldSize;
+    size_t newEnd = end + newSize - oldSize;
+
+    // Point the rows on either side into the new file. Any that are not in the original buffer mean the rows
+    // cannot be trusted to be the file as it was, and the caller starts over
+    editorRow *row = editorRowAt(0);
+    int64_t i;
+    for (i = 0; i < first; i++, row = editorRowNext(row)) {
+        if (!editorRowMove(row, store, 0)) return 0;
+    }
+    for (row = editorRowAt(last); row; row = editorRowNext(row)) {
+        if (!editorRowMove(row, store, (int64_t)newSize - (int64_t)oldSize)) return 0;
+    }
+
+    // Lay out the lines in between. Where the old version is intact, whole lines that are the same at either end
+    // of them are kept as they are (and so is the cursor, if it is on one)
+    struct lineIndex index = {NULL, 0, 0, NULL};
+    editorScanLines(&index, &store->orig[start], newEnd - start);
+    int64_t lines = index.numLines;
+    const struct rowPiece *line = index.lines;
+    while (intact && first < last && lines > 0 && editorRowIs(editorRowAt(first), line)) {
+        editorRowRepoint(editorRowAt(first), line->chars);
+        first++;
+        line++;
+        lines--;
+    }
+    while (intact && first < last && lines > 0 && editorRowIs(editorRowAt(last - 1), &line[lines - 1])) {
+        editorRowRepoint(editorRowAt(last - 1), line[lines - 1].chars);
+        last--;
+        lines--;
+    }
+    editorWindowDropRows(first, last);
+    editorInsertRows(first, line, lines);
+    if (lines == 0 && first < E.numRows) {
+        editorRowUnrender(editorRowAt(first)); // Its comment state came from the rows that went
+    }
+    free(index.lines);
+    pieceStoreRelease(E.store);
+    E.store = store;
+    E.dirtyFrom = SIZE_MAX;
+    E.rowsGeneration++;
+
+    // The cursor and screen stay on the same text, unless it was in the lines that changed
+    int64_t moved = lines - (last - first);
+    int64_t limit = first + (lines > 0 ? lines - 1 : 0);
+    if (E.cursorY >= last) E.cursorY += moved;
+    else if (E.cursorY > limit) E.cursorY = limit;
+    if (E.rowOffset >= last) E.rowOffset += moved;
+    else if (E.rowOffset > limit) E.rowOffset = limit;
+    if (E.cursorY > E.numRows) E.cursorY = E.numRows;
+    row = editorRowAt(E.cursorY);
+    if (row == NULL || E.cursorX > row->size) E.cursorX = row ? row->size : 0;
+    return 1;
+}
+
+// A file changed from outside while the buffer was clean, so take the new version in: just the lines that changed
+// where that can be worked out, and otherwise the whole file, with the cursor kept where it was
+void editorReload(const struct stat *fileStat) {
+    int fd = open(E.fileName, O_RDONLY);
+    if (fd == -1) return;
+    struct pieceStore *store = pieceStoreNew();
+    pieceStoreLoad(store, fd, fileStat->st_size);
+    close(fd);
+    E.watch.known = store->origStat;
+
+    // The hashes of the file as it was are needed to compare against
+    struct blockHashes *hashes = &E.watch.hashes;
+    if (hashes->running) {
+        pthread_join(hashes->thread, NULL);
+        hashes->running = 0;
+    }
+    if (!E.window.active && editorReloadRows(store)) {
+        editorHashStart(E.fileName);
+        if (E.journal.active) {
+            editorJournalCreate(E.journal.file, &E.store->origStat, NULL, 0); // Edits are now edits of the new version
+        }
+    }
+    else {
+        size_t offset = editorCursorOffset();
+        int64_t cursorY = E.cursorY, cursorX = E.cursorX, rowOffset = E.rowOffset;
+        char *path = strdup(E.fileName);
+        editorOpen(path);
+        free(path);
+        if (E.window.active) {
+            editorWindowJump(offset);
+        }
+        else {
+            E.cursorY = cursorY > E.numRows ? E.numRows : cursorY;
+            E.rowOffset = rowOffset > E.cursorY ? E.cursorY : rowOffset;
+            editorRow *row = editorRowAt(E.cursorY);
+            E.cursorX = row == NULL ? 0 : cursorX > row->size ? row->size : cursorX;
+        }
+        pieceStoreRelease(store); // Only now, since rows may have been pointed into it
+    }
+    editorSetStatusMessage("File changed on disk, reloaded");
+}
+
+// Called while waiting for a key: look into anything done to the file from outside. Once it has been quiet for a
+// poll (so a write still going on is not read half done), a clean buffer takes the change in, and a buffer with
+// edits is marked, so saving it asks before overwriting the change. Returns whether anything changed that should be drawn
+int editorWatchPoll() {
+    struct fileWatch *watch = &E.watch;
+    if (watch->inotify == -1 || E.save.active) return 0; // A save's own writes are not a change from outside
+
+#ifdef SIMPAD_INOTIFY
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    int seen = 0;
+    while ((length = read(watch->inotify, events, sizeof(events))) > 0) {
+        ssize_t at;
+        for (at = 0; at < length; at += sizeof(struct inotify_event) + ((struct inotify_event *)&events[at])->len) {
+            struct inotify_event *event = (struct inotify_event *)&events[at];
+            if (event->len && !strcmp(event->name, watch->name)) seen = 1;
+        }
+    }
+    if (seen) {
+        watch->pending = 1;
+        return 0;
+    }
+#endif
+    if (!watch->pending || E.loader.active) return 0;
+    watch->pending = 0;
+
+    struct stat fileStat;
+    if (stat(E.fileName, &fileStat) == -1 || !S_ISREG(fileStat.st_mode) || editorSameFile(&fileStat, &watch->known)) {
+        return 0;
+    }
+    if (editorIsDirty()) {
+        editorDetachRows(&fileStat); // Before the file changes any further, so the edits are saved on top of what was loaded
+        watch->known = fileStat;
+        watch->changed = 1;
+        editorSetStatusMessage("File changed on disk! Saving will overwrite that change");
+        return 1;
+    }
+    editorReload(&fileStat);
+    return 1;
+}
+
+/************ JOURNAL ************/
+
+// The journal of a file is kept next to it, as .<name>.simpad-journal
+char *editorJournalPath(const char *file) {
+    const char *slash = strrchr(file, '/');
+    int directory = slash ? (int)(slash - file) + 1 : 0;
+    size_t length = strlen(file) + sizeof("..simpad-journal");
+    char *path = malloc(length);
+    if (path == NULL) die("malloc");
+    snprintf(path, length, "%.*s.%s.simpad-journal", directory, file, file + directory);
+    return path;
+}
+
+void editorJournalHeader(struct journalHeader *header, const struct stat *fileStat) {
+    memset(header, 0, sizeof(struct journalHeader));
+    memcpy(header->magic, "SIMPADJ1", 8);
+    header->device = fileStat->st_dev;
+    header->inode = fileStat->st_ino;
+    header->size = fileStat->st_size;
+    header->modified = fileStat->st_mtime;
+#ifdef __linux__
+    header->modifiedNanoseconds = fileStat->st_mtim.tv_nsec;
+#endif
+}
+
+// Stop journaling, leaving the journal where it is unless discard is set (nothing in it is wanted any more)
+void editorJournalClose(int discard) {
+    struct editorJournal *journal = &E.journal;
+    editorJournalJoin();
+    if (!journal->active) return; // Possibly just now, if the last batch could not be written
+    if (discard) {
+        unlink(journal->path);
+    }
+    else {
+        editorJournalFlush();
+        if (!journal->active) return;
+    }
+    close(journal->fd);
+    free(journal->file);
+    free(journal->path);
+    journal->file = NULL;
+    journal->path = NULL;
+    journal->used = 0;
+    journal->active = 0;
+}
+
+// Write a new journal for file, as it is in fileStat, starting with the records in tail, and journal to it from
+// now on. It is written aside and renamed into place, so a crash leaves either the old journal or the new one
+void editorJournalCreate(const char *file, const struct stat *fileStat, const char *tail, size_t length) {
+    struct editorJournal *journal = &E.journal;
+    editorJournalJoin(); // A batch still being written to the old journal must not land in it after it is renamed over
+    char *path = editorJournalPath(file);
+    size_t temporaryLength = strlen(path) + sizeof(".new");
+    char *temporary = malloc(temporaryLength);
+    if (temporary == NULL) die("malloc");
+    snprintf(temporary, temporaryLength, "%s.new", path);
+
+    struct journalHeader header;
+    editorJournalHeader(&header, fileStat);
+    struct iovec parts[2] = {{&header, sizeof(header)}, {(void *)tail, length}};
+    int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    int failed = fd == -1 || writev(fd, parts, 2) != (ssize_t)(sizeof(header) + length) ||
+                 (E.durability != DURABILITY_NONE && fdatasync(fd) == -1) || rename(temporary, path) == -1;
+    if (failed) {
+        if (fd != -1) {
+            close(fd);
+            unlink(temporary);
+        }
+        editorSetStatusMessage("Can't write the journal: %s", strerror(errno));
+        free(temporary);
+        free(path);
+        return;
+    }
+    free(temporary);
+
+    // The old journal goes, unless the new one has just replaced it (file may be the old journal's own copy). Records
+    // not written yet are not flushed to it, as it may be gone already: they are the newest edits, so they carry on
+    // into the new journal instead
+    char *copy = strdup(file);
+    if (journal->active) {
+        if (strcmp(journal->path, path) != 0) {
+            unlink(journal->path);
+        }
+        close(journal->fd);
+        free(journal->file);
+        free(journal->path);
+    }
+    journal->active = 1;
+    journal->fd = fd;
+    journal->file = copy;
+    journal->path = path;
+    journal->length = sizeof(header) + length;
+}
+
+// Write records to the journal as one batch, synced to disk unless saves are not synced either. Returns the
+// bytes written, or -1
+ssize_t editorJournalWrite(int fd, const char *records, size_t used) {
+    struct journalBatch batch = {used, (uint32_t)editorHash(records, used)};
+    struct iovec parts[2] = {{&batch, sizeof(batch)}, {(void *)records, used}};
+    ssize_t length = sizeof(batch) + used;
+    if (writev(fd, parts, 2) != length || (E.durability != DURABILITY_NONE && fdatasync(fd) == -1)) {
+        return -1;
+    }
+    return length;
+}
+
+// A batch that could not be written stops journaling, since anything written after a torn batch could never be
+// replayed
+void editorJournalFailed(int error) {
+    editorSetStatusMessage("Can't write the journal: %s", strerror(error));
+    E.journal.used = 0;
+    editorJournalClose(0);
+}
+
+// Writes the batch it was handed on its own thread, so the editor does not wait on the disk syncing it
+void *editorJournalThread(void *arg) {
+    struct editorJournal *journal = arg;
+    int error = editorJournalWrite(journal->fd, journal->flushing, journal->flushingUsed) == -1 ? errno : 0;
+
+    pthread_mutex_lock(&journal->lock);
+    journal->error = error;
+    journal->written = 1;
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+// Wait for the batch being written on the thread, if there is one, and count it as part of the journal
+void editorJournalJoin() {
+    struct editorJournal *journal = &E.journal;
+    if (!journal->writing) return;
+    pthread_join(journal->thread, NULL);
+    pthread_mutex_destroy(&journal->lock);
+    journal->writing = 0;
+    if (journal->error) {
+        editorJournalFailed(journal->error);
+        return;
+    }
+    journal->length += sizeof(struct journalBatch) + journal->flushingUsed;
+}
+
+// Hand the records gathered so far to a thread to write, as one batch, without waiting for it. While the last
+// batch is still being written they keep gathering, and go as one batch once it is done
+void editorJournalHandOff() {
+    struct editorJournal *journal = &E.journal;
+    if (journal->writing) {
+        pthread_mutex_lock(&journal->lock);
+        int written = journal->written;
+        pthread_mutex_unlock(&journal->lock);
+        if (!written) return;
+        editorJournalJoin();
+    }
+    if (!journal->active || journal->used == 0) return;
+
+    // Swap buffers: the records go to the thread, and the next ones gather in the buffer it was done with
+    char *records = journal->batch;
+    size_t capacity = journal->capacity;
+    journal->batch = journal->flushing;
+    journal->capacity = journal->flushingCapacity;
+    journal->flushing = records;
+    journal->flushingCapacity = capacity;
+    journal->flushingUsed = journal->used;
+    journal->used = 0;
+
+    journal->written = 0;
+    journal->error = 0;
+    pthread_mutex_init(&journal->lock, NULL);
+    journal->writing = pthread_create(&journal->thread, NULL, editorJournalThread, journal) == 0;
+    if (!journal->writing) {
+        // No thread to be had, so write it now
+        pthread_mutex_destroy(&journal->lock);
+        ssize_t length = editorJournalWrite(journal->fd, journal->flushing, journal->flushingUsed);
+        if (length == -1) {
+            editorJournalFailed(errno);
+            return;
+        }
+        journal->length += length;
+    }
+}
+
+// Write out every record gathered so far, and wait until it is written (before the journal is read back, replaced
+// or let go of)
+void editorJournalFlush() {
+    struct editorJournal *journal = &E.journal;
+    editorJournalJoin();
+    if (!journal->active || journal->used == 0) return;
+
+    ssize_t length = editorJournalWrite(journal->fd, journal->batch, journal->used);
+    if (length == -1) {
+        editorJournalFailed(errno);
+        return;
+    }
+    journal->length += length;
+    journal->used = 0;
+}
+
+void editorJournalPut(const void *bytes, size_t length) {
+    struct editorJournal *journal = &E.journal;
+    if (journal->used + length > journal->capacity) {
+        size_t capacity = journal->capacity ? journal->capacity : 4096;
+        while (capacity < journal->used + length) capacity *= 2;
+        char *batch = realloc(journal->batch, capacity);
+        if (batch == NULL) die("realloc");
+        journal->batch = batch;
+        journal->capacity = capacity;
+    }
+    memcpy(&journal->batch[journal->used], bytes, length);
+    journal->used += length;
+}
+
+// Numbers are written seven bits to a byte, low bits first, so small ones (most lengths) take a single byte
+void editorJournalPutNumber(uint64_t number) {
+    unsigned char bytes[10];
+    size_t length = 0;
+    while (number >= 0x80) {
+        bytes[length++] = (number & 0x7f) | 0x80;
+        number >>= 7;
+    }
+    bytes[length++] = number;
+    editorJournalPut(bytes, length);
+}
+
+// Add an edit to the journal: the kind of edit, the byte offset (in the file as it would be saved) of column of
+// row (or of the end of the buffer, for a NULL row) and any text that goes with it
+void editorJournalRecord(int type, editorRow *row, size_t column, const char *s, size_t length) {
+    struct editorJournal *journal = &E.journal;
+    if (!journal->active) return;
+
+    size_t offset = (row ? editorRowOffset(row) : rowTreeBytes(E.rows)) + column;
+    if (E.window.active) {
+        offset += editorWindowStartBytes();
+    }
+    if (journal->used == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &journal->since);
+    }
+    unsigned char kind = type;
+    editorJournalPut(&kind, 1);
+    editorJournalPutNumber(offset);
+    if (type == JOURNAL_INSERT_CHARACTER) {
+        editorJournalPut(s, 1);
+    }
+    else if (type == JOURNAL_INSERT_ROW || type == JOURNAL_APPEND_STRING) {
+        editorJournalPutNumber(length);
+        editorJournalPut(s, length);
+    }
+
+    // Keys typed without a pause would otherwise keep their records back for as long as the typing goes on
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long waited = (now.tv_sec - journal->since.tv_sec) * 1000 + (now.tv_nsec - journal->since.tv_nsec) / 1000000;
+    if (journal->used >= SIMPAD_JOURNAL_BATCH || waited >= SIMPAD_JOURNAL_DELAY) {
+        editorJournalHandOff();
+    }
+}
+
+// Called while waiting for a key: the edits made since the last pause go to the journal as one batch
+int editorJournalPoll() {
+    editorJournalHandOff();
+    return 0;
+}
+
+int editorJournalGetNumber(const unsigned char **p, const unsigned char *end, uint64_t *number) {
+    int shift;
+    *number = 0;
+    for (shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *number |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 1;
+    }
+    return 0;
+}
+
+// The row a byte offset of the file falls in, and where in the row. In windowed mode the window moves to the offset
+// first, unless it is in the window already (as edits made one after another mostly are)
+int64_t editorJournalSeek(size_t offset, size_t *column) {
+    if (!E.window.active) return editorLineAtOffset(offset, column);
+
+    size_t start = editorWindowStartBytes();
+    size_t end = start + rowTreeBytes(E.rows);
+    if (offset < start || offset > end || (offset == end && editorWindowMoreBelow())) {
+        editorWindowJump(offset);
+        start = editorWindowStartBytes();
+    }
+    return editorLineAtOffset(offset - start, column);
+}
+
+// Make the edit a record stands for, through the same row operations that made it the first time. Returns whether
+// the record made sense for the buffer as it is
+int editorJournalApply(int type, size_t offset, const char *s, size_t length) {
+    size_t column;
+    int64_t line = editorJournalSeek(offset, &column);
+    editorRow *row = editorRowAt(line);
+
+    switch (type) {
+        case JOURNAL_INSERT_CHARACTER:
+            if (row == NULL) return 0;
+            editorRowInsertCharacter(row, column, (unsigned char)s[0]);
+            column++;
+            break;
+        case JOURNAL_DELETE_CHARACTER:
+            if (row == NULL || column >= (size_t)row->size) return 0;
+            editorRowDeleteCharacter(row, column);
+            break;
+        case JOURNAL_INSERT_ROW: {
+            if (column != 0) return 0;
+            char *chars = addBufferReserve(length); // Rows point at their text, so it has to be kept
+            memcpy(chars, s, length);
+            editorInsertRow(line, chars, length);
+            break;
+        }
+        case JOURNAL_DELETE_ROW:
+            if (row == NULL || column != 0) return 0;
+            editorDeleteRow(line);
+            break;
+        case JOURNAL_APPEND_STRING:
+            if (row == NULL || column != (size_t)row->size) return 0;
+            editorRowAppendString(row, s, length);
+            break;
+        case JOURNAL_TRUNCATE_ROW:
+            if (row == NULL) return 0;
+            editorRowTruncate(row, column);
+            break;
+        default:
+            return 0;
     }
+    // The cursor ends up on the last edit
+    E.cursorY = line;
+    E.cursorX = column;
+    return 1;
 }
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.fileName == NULL) return; // If there is no file name or there is no match, then there is no filetype
-
-    // Isolate the extension (find the last occurrence of the . character)
-    char *extension = strrchr(E.fileName, '.'); 
-
-    for (unsigned int j = 0; j < highlightDBEntries; j++) {
-        struct editorSyntax *s = &highlightDB[j];
-
-        unsigned int i = 0;
-
-        while (s->fileMatch[i]) {
-            int isExtension = (s->fileMatch[i][0] == '.');
-            if ((isExtension && extension && !strcmp(extension, s->fileMatch[i])) || 
-                (!isExtension && strstr(E.fileName, s->fileMatch[i]))) {
-                    E.syntax = s;
+// Replay the records of a journal over the buffer, batch by batch, up to the first one that is torn or does not
+// fit. Returns how many bytes of the journal were good, or -1 if it is not a journal of the file as it is now
+off_t editorJournalReplay(int fd, long *edits) {
+    struct stat journalStat;
+    if (fstat(fd, &journalStat) == -1 || journalStat.st_size < (off_t)sizeof(struct journalHeader)) return -1;
+    size_t size = journalStat.st_size;
+    char *bytes = malloc(size);
+    if (bytes == NULL) die("malloc");
+    struct journalHeader header, expected;
+    editorJournalHeader(&expected, &E.store->origStat);
+    if (ioReadSync(fd, bytes, size, 0) != (ssize_t)size ||
+        (memcpy(&header, bytes, sizeof(header)), memcmp(&header, &expected, sizeof(header)))) {
+        free(bytes);
+        return -1;
+    }
 
-                    // Once we set the filetype after creating a file, we re-highlight everything
-                    int fileRow;
-                    for (fileRow = 0; fileRow < E.numRows; fileRow++){
-                        editorUpdateSyntax(&E.row[fileRow]);
-                    }
-                    return;
-            }
-            i++;
+    size_t good = sizeof(header);
+    *edits = 0;
+    while (size - good >= sizeof(struct journalBatch)) {
+        struct journalBatch batch;
+        memcpy(&batch, &bytes[good], sizeof(batch));
+        const unsigned char *p = (const unsigned char *)&bytes[good + sizeof(batch)];
+        if (batch.length > size - good - sizeof(batch) || (uint32_t)editorHash((const char *)p, batch.length) != batch.hash) break;
+
+        const unsigned char *end = p + batch.length;
+        while (p < end) {
+            int type = *p++;
+            uint64_t offset, length = type == JOURNAL_INSERT_CHARACTER;
+            if (!editorJournalGetNumber(&p, end, &offset)) break;
+            if ((type == JOURNAL_INSERT_ROW || type == JOURNAL_APPEND_STRING) && !editorJournalGetNumber(&p, end, &length)) break;
+            if (length > (uint64_t)(end - p) || !editorJournalApply(type, offset, (const char *)p, length)) break;
+            p += length;
+            (*edits)++;
         }
+        if (p < end) break; // A record that did not fit the buffer: nothing after it can be trusted either
+        good += sizeof(batch) + batch.length;
     }
+    free(bytes);
+    return good;
 }
 
-/************ ROW OPERATIONS ************/
+// Start journaling the edits of a file just opened. With simpad -r its journal is replayed first, and carried on
+// from. Otherwise a journal left behind by a crash is never written over without asking: the user either
+// recovers it (as -r would) or throws it away, and journaling starts over
+void editorJournalStart(const char *fileName) {
+    struct editorJournal *journal = &E.journal;
+    char *file = realpath(fileName, NULL);
+    if (file == NULL) return;
+    char *path = editorJournalPath(file);
+    int fd = open(path, journal->recover ? O_RDWR | O_APPEND : O_RDONLY);
+    struct stat journalStat;
+    if (fd != -1 && !journal->recover && (fstat(fd, &journalStat) == -1 || journalStat.st_size <= (off_t)sizeof(struct journalHeader))) {
+        close(fd); // No edits in it, so nothing to ask about
+        fd = -1;
+    }
 
-// Convert a chars index to a render index, and figure out how many spaces each tabbed space occupies
-int editorRowCursorXToRenderX(editorRow *row, int cursorX){
-    int renderX = 0;
-    int i;
-    for (i = 0; i < cursorX; i++){
-        if (row->chars[i] == '\t'){
-            renderX += (SIMPAD_TAB_STOP - 1) - (renderX % SIMPAD_TAB_STOP);
+    if (fd != -1 && journal->recover) {
+        journal->recover = 0;
+        editorLoadFinish(); // Every row has to be there to replay the edits over
+        long edits = 0;
+        off_t good = editorJournalReplay(fd, &edits);
+        if (good == -1) {
+            // It could never be replayed, so it makes way for a journal of the file as it is
+            close(fd);
+            editorJournalCreate(file, &E.store->origStat, NULL, 0);
+            editorSetStatusMessage("The journal was not of the file as it is now, so it was thrown away");
+        }
+        else {
+            ftruncate(fd, good); // Drop a torn batch at the end, so new ones follow on from the last good one
+            journal->active = 1;
+            journal->fd = fd;
+            journal->file = file;
+            journal->path = path;
+            journal->length = good;
+            journal->used = 0;
+            editorSetStatusMessage("Recovered %ld edits from the journal", edits);
+            return;
         }
-        renderX++;
     }
-    return renderX;
+    else if (fd != -1) {
+        close(fd);
+        char *answer = NULL;
+        while (answer == NULL || (tolower(answer[0]) != 'y' && tolower(answer[0]) != 'n')) {
+            free(answer);
+            answer = editorPrompt("Found a journal of unsaved edits! Recover them? (y/n): %s", NULL);
+        }
+        int recover = tolower(answer[0]) == 'y';
+        free(answer);
+        if (recover) {
+            journal->recover = 1;
+            editorJournalStart(fileName);
+        }
+        else {
+            editorJournalCreate(file, &E.store->origStat, NULL, 0);
+            editorSetStatusMessage("Threw away the journal of unsaved edits");
+        }
+    }
+    else {
+        if (journal->recover) {
+            editorSetStatusMessage("No journal found to recover");
+        }
+        journal->recover = 0;
+        editorJournalCreate(file, &E.store->origStat, NULL, 0);
+    }
+    free(file);
+    free(path);
 }
 
-int editorRowRenderXToCursorX(editorRow *row, int renderX){
-    int cursorRenderX = 0;
-    int cursorX;
-    for (cursorX = 0; cursorX < row->size; cursorX++){
-        if (row->chars[cursorX] == '\t'){
-            cursorRenderX += (SIMPAD_TAB_STOP - 1) - (cursorRenderX % SIMPAD_TAB_STOP);
+// After a save the journal starts over from the file just written. Only the records of edits made while the save
+// ran (which are edits of what was saved) are carried over
+void editorJournalRebase(struct backgroundSave *save) {
+    struct editorJournal *journal = &E.journal;
+    struct stat fileStat;
+    if (E.follow.enabled || E.stream.active || fstat(save->fd, &fileStat) == -1) return;
+
+    char *tail = NULL;
+    size_t length = 0;
+    if (journal->active) {
+        editorJournalFlush();
+    }
+    if (journal->active) {
+        length = journal->length - save->journalMark;
+        tail = malloc(length + 1);
+        if (tail == NULL) die("malloc");
+        if (ioReadSync(journal->fd, tail, length, save->journalMark) != (ssize_t)length) {
+            length = 0; // The edits are lost from the journal, though not from the buffer
         }
-        cursorRenderX++;
-
-        if (cursorRenderX > renderX) return cursorX;
     }
-    return cursorX;
+    editorJournalCreate(save->path, &fileStat, tail, length);
+    free(tail);
 }
 
-// Reads the characters from an editorRow to fill the contents of a 
-// rendered row (The one to ACTUALLY be displayed)
-void editorUpdateRow(editorRow *row){
-    int tabs = 0;
-    int i;
+/************ FILE INPUT/OUTPUT ************/
 
-    for (i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') tabs++;
-    }
-    free(row->render);
-    row->render = malloc(row->size + tabs*(SIMPAD_TAB_STOP - 1) + 1);
+// After a save the file on disk holds exactly the rows (from byte start on), so point them into a fresh mapping of
+// it. That lets go of the add buffer and of the file that was replaced, which stays on disk for as long as it is mapped
+void editorRebaseRows(int fd, size_t length, size_t start) {
+    struct pieceStore *store = pieceStoreNew();
+    pieceStoreLoad(store, fd, length);
 
-    // Render tabs as multiple spaces
-    int index = 0;
-    for (i = 0; i < row->size; i++){
-        if (row->chars[i] == '\t'){
-            row->render[index++] = ' ';
-            while(index % SIMPAD_TAB_STOP != 0) {
-                row->render[index++] = ' ';
-            }
-        } else {
-            row->render[index++] = row->chars[i];
-        } 
+    const char *p = store->orig + start;
+    editorRow *row;
+    for (row = editorRowAt(0); row; row = editorRowNext(row)) {
+        if (row->render == row->chars) row->render = p;
+        row->chars = p;
+        p += row->size + 1;
     }
-    // Index now contains the number of chars copied into row->render
-    row->render[index] = '\0';
-    row->renderSize = index;
+    pieceStoreRelease(E.store);
+    E.store = store;
+}
 
-    // Update the highlighted array (All we are doing is updating the array in the event we choose to highlight it)
-    editorUpdateSyntax(row);
+// After a save the file on disk is the whole buffer, so the window's rows move over to it and every patch is in it
+void editorWindowRebase(int fd, size_t length) {
+    struct fileWindow *window = &E.window;
+    size_t start = editorWindowStartBytes();
+    editorCheckpointStop(); // It reads the mapping that is about to go
+    editorRebaseRows(fd, length, start);
+
+    window->start = start;
+    window->end = start + rowTreeBytes(E.rows);
+    if (window->end > E.store->origSize) window->end = E.store->origSize;
+    window->origLines = E.numRows;
+    window->numPatches = 0;
+    window->split = 0;
+    window->generation++;
+    editorCheckpointStart(E.store->orig, E.store->origSize);
+}
+
+// Drop the buffer of the file that is open. Row payloads go back with the arena in one go instead of row by row
+void editorCloseFile() {
+    editorLoadCancel();
+    editorStreamCancel();
+    editorFollowStop();
+    editorWatchStop();
+    editorSaveFinish();
+    editorJournalClose(1); // Its edits are being thrown away with the buffer
+    editorWindowClose();
+    E.rows = NULL;
+    E.numRows = 0;
+    E.rowsGeneration++;
+    rowChunksReset();
+    arenaReset();
+
+    // Snapshots still being read keep their own reference to the old store
+    pieceStoreRelease(E.store);
+    E.store = pieceStoreNew();
+    E.gap.row = NULL;
+
+    E.cursorX = 0;
+    E.cursorY = 0;
+    E.rowOffset = 0;
+    E.colOffset = 0;
 }
 
-void editorInsertRow(int at, char *s, size_t length) {
-    if (at < 0 || at > E.numRows) return;
+// Responsible for opening and reading a file 
+void editorOpen(char *fileName) {
+    editorCloseFile();
+    free(E.fileName);
+    E.fileName = strdup(fileName);
+
+    editorSelectSyntaxHighlight();
 
-    // Multiply num of bytes each row occupies by the number of rows we want
-    E.row = realloc(E.row, sizeof(editorRow) * (E.numRows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(editorRow) * (E.numRows - at)); // make room at specified index for the new row
-    // Update the index value if a newline is inserted
-    for (int j = at + 1; j <= E.numRows; j++) {
-        E.row[j].index++;
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) {
+        die("open");
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1) {
+        die("fstat");
     }
 
-    E.row[at].index = at;
+    // Map the file as the original buffer; every row is then a piece pointing into it
+    struct pieceStore *store = E.store;
+    pieceStoreLoad(store, fd, fileStat.st_size);
+    close(fd);
+
+    // Followed files are always laid out in full, so rows can be appended to them
+    if (!E.follow.enabled && editorWindowWanted(store->origSize)) {
+        editorWindowOpen();
+        E.dirtyFrom = SIZE_MAX;
+        editorWatchStart(fileName);
+        editorJournalStart(fileName);
+        return;
+    }
 
-    E.row[at].size = length;
-    E.row[at].chars = malloc(length + 1);
-    memcpy(E.row[at].chars, s, length);
-    E.row[at].chars[length] = '\0';
+    // Lay out about a screen's worth of lines straight away (in one bulk insert), and leave the rest to the loader
+    size_t firstLength = store->origSize;
+    if (firstLength > SIMPAD_FIRST_PAINT) {
+        const char *newline = memchr(&store->orig[SIMPAD_FIRST_PAINT], '\n', store->origSize - SIMPAD_FIRST_PAINT);
+        firstLength = newline ? (size_t)(newline - store->orig) + 1 : store->origSize;
+    }
+    struct lineIndex index = {NULL, 0, 0, NULL};
+    editorScanLinesParallel(&index, store->orig, firstLength);
+    editorInsertRows(0, index.lines, index.numLines);
+    free(index.lines);
+    if (firstLength < store->origSize) {
+        editorLoadStart(store->orig, firstLength, store->origSize);
+    }
+    E.dirtyFrom = SIZE_MAX;
 
-    E.row[at].renderSize = 0;
-    E.row[at].render = NULL;
-    E.row[at].highlight = NULL;
-    E.row[at].highlightOpenComment = 0;
-    editorUpdateRow(&E.row[at]);
+    if (E.follow.enabled) {
+        editorFollowStart(fileName, store->origSize, store->origSize > 0 && store->orig[store->origSize - 1] != '\n');
+    }
+    else {
+        editorWatchStart(fileName);
+        editorJournalStart(fileName);
+    }
+}
 
-    E.numRows++;
-    E.changed++;
+// Read the buffer from a stream (simpad -) rather than a file. It has no name until it is saved somewhere, and
+// its lines show up as they arrive
+void editorOpenStream(int fd) {
+    editorCloseFile();
+    free(E.fileName);
+    E.fileName = NULL;
+    editorSelectSyntaxHighlight();
+    E.dirtyFrom = SIZE_MAX;
+    editorStreamStart(fd);
+    editorStreamPoll(); // Anything that is already there (all of it, without a thread)
 }
-// Free the memory occupied by the editor row we are freeing
-void editorFreeRow(editorRow *row){
-    free(row->render);
-    free(row->chars);
-    free(row->highlight);
+
+// Open the file a store was loaded from, if it is still there as it was, so stretches of it can be copied from
+// the file itself rather than out of memory. Returns -1 if it cannot be used
+int editorOpenOriginal(const char *path, struct pieceStore *store) {
+#ifdef SIMPAD_COPY_RANGE
+    if (!store->mapped) return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1 || !editorSameFile(&fileStat, &store->origStat) || (size_t)fileStat.st_size != store->origSize) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)path;
+    (void)store;
+    return -1;
+#endif
 }
 
-void editorDeleteRow(int at){
-    if (at < 0 || at >= E.numRows) return; // Validate the at index
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(editorRow) * (E.numRows - at - 1)); // Overwrite the deleted row with the rest of the rows that come after it
+// Once the last piece of a batch is complete, check whether it is a long untouched stretch of the original file.
+// If it is, it comes out of the batch and the kernel copies it from file to file instead, without the bytes
+// passing through simpad or the page cache being read for them (on filesystems that can share extents, they are
+// not even copied). Whatever could not be copied goes back in the batch
+void editorCopyOriginal(struct ioWriter *writer, struct ioBatch **batch, off_t *offset, int *source,
+                        struct pieceStore *store) {
+#ifdef SIMPAD_COPY_RANGE
+    struct iovec *last = &(*batch)->iov[(*batch)->count - 1];
+    const char *chars = last->iov_base;
+    if (*source == -1 || last->iov_len < SIMPAD_COPY_MIN ||
+        chars < store->orig || chars >= store->orig + store->origSize) {
+        return;
+    }
 
-    // Update the index value if a line is deleted
-    for (int j = at; j < E.numRows; j++) {
-        E.row[j].index--;
+    // Send everything before it out first
+    size_t length = last->iov_len;
+    (*batch)->count--;
+    (*batch)->length -= length;
+    ioWriterSubmit(writer, *batch, *offset);
+    *offset += (*batch)->length;
+    *batch = ioWriterNext(writer);
+
+    loff_t from = chars - store->orig;
+    loff_t to = *offset;
+    size_t copied = 0;
+    while (copied < length) {
+        __sync_add_and_fetch(&E.io.copies, 1);
+        ssize_t done = syscall(__NR_copy_file_range, *source, &from, writer->fd, &to, length - copied, 0);
+        if (done == -1 && errno == EINTR) continue;
+        if (done <= 0) {
+            // Not between these files (or not on this kernel); write from memory from here on
+            close(*source);
+            *source = -1;
+            break;
+        }
+        copied += done;
+        __sync_add_and_fetch(writer->progress, done);
     }
-    E.numRows--; // Decrement the total number of rows by 1
-    E.changed++;
+    *offset += copied;
+    if (copied < length) {
+        (*batch)->iov[0].iov_base = (char *)chars + copied;
+        (*batch)->iov[0].iov_len = length - copied;
+        (*batch)->count = 1;
+        (*batch)->length = length - copied;
+    }
+#else
+    (void)writer;
+    (void)batch;
+    (void)offset;
+    (void)source;
+    (void)store;
+#endif
 }
 
-void editorRowInsertCharacter(editorRow *row, int at, int character) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // Overwrite the deleted characters with the ones that come after
-    row->size++;
-    row->chars[at] = character;
+// Stream a snapshot to a file straight out of its pieces, a batch of pieces per writev, instead of copying the
+// whole buffer together first. Rows that follow each other in the original buffer (with the newline between
+// them) go out as a single piece, so an untouched stretch of the file is one piece however many lines it has,
+// and is copied straight from source (the original file, or -1) when it is long enough. Besides the batches of
+// iovecs and the cursor's path down the tree, the only extra memory a save takes is the row nodes that edits made
+// while it runs copy away from the snapshot, which grows with those edits rather than with the file
+int editorWriteSnapshot(int fd, struct bufferSnapshot *snapshot, int source, size_t *progress) {
+    static char newline[] = "\n";
+    struct ioWriter writer;
+    ioWriterOpen(&writer, fd, progress);
+    struct ioBatch *batch = ioWriterNext(&writer);
+    off_t offset = 0;
+    const char *runEnd = NULL; // Where the last piece ends, if the next row can carry straight on from it
+    const char *orig = snapshot->store->orig;
+    const char *origEnd = orig + snapshot->store->origSize;
+    struct snapshotCursor cursor = {NULL, 0, NULL, 0, 0};
+
+    for (snapshotSeek(&cursor, snapshot, 0); cursor.line < snapshot->numRows; snapshotNext(&cursor)) {
+        struct rowPiece piece = snapshotRow(&cursor);
+        const char *chars = piece.chars;
+        size_t size = piece.size;
+
+        // Only the original buffer is known to hold each line's newline right after it
+        int newlineFollows = chars >= orig && chars + size < origEnd && chars[size] == '\n';
+        if (newlineFollows) size++;
+
+        if (size > 0) {
+            if (chars == runEnd) {
+                batch->iov[batch->count - 1].iov_len += size;
+            }
+            else {
+                if (batch->count > 0) {
+                    editorCopyOriginal(&writer, &batch, &offset, &source, snapshot->store);
+                }
+                if (batch->count == SIMPAD_IOV_BATCH) {
+                    ioWriterSubmit(&writer, batch, offset);
+                    offset += batch->length;
+                    batch = ioWriterNext(&writer);
+                }
+                batch->iov[batch->count].iov_base = (char *)chars;
+                batch->iov[batch->count].iov_len = size;
+                batch->count++;
+            }
+            batch->length += size;
+            runEnd = chars + size;
+        }
+        if (!newlineFollows) {
+            if (batch->count > 0) {
+                editorCopyOriginal(&writer, &batch, &offset, &source, snapshot->store);
+            }
+            if (batch->count == SIMPAD_IOV_BATCH) {
+                ioWriterSubmit(&writer, batch, offset);
+                offset += batch->length;
+                batch = ioWriterNext(&writer);
+            }
+            batch->iov[batch->count].iov_base = newline;
+            batch->iov[batch->count].iov_len = 1;
+            batch->count++;
+            batch->length++;
+            runEnd = NULL;
+        }
+    }
+    snapshotCursorFree(&cursor);
+    if (batch->count > 0) {
+        editorCopyOriginal(&writer, &batch, &offset, &source, snapshot->store);
+    }
+    ioWriterSubmit(&writer, batch, offset);
+    if (source != -1) close(source);
+    return ioWriterFinish(&writer);
+}
 
-    editorUpdateRow(row);
-    E.changed++;
+// Sync the directory a file is in, which is what makes a rename in it stick. Failing to is not worth
+// failing the save over, since the file itself is already safely written
+void editorSyncDirectory(const char *path) {
+    char *slash = strrchr(path, '/');
+    char *directory = slash ? strndup(path, slash - path + 1) : strdup(".");
+    if (directory == NULL) return;
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(directory);
 }
 
-void editorRowAppendString(editorRow *row, char *s, size_t length){
-    // The empty row's new size is the empty row + the length of the row below it + the null byte
-    row->chars = realloc(row->chars, row->size + length + 1); 
+// Save by streaming the rows into a new file next to the old one, which then takes its place in one atomic rename.
+// The rows may point into a mapping of this very file, so they cannot be written over it; and whatever happens
+// part way through (a crash, a full disk), the old file is left as it was. Returns the new file, still open
+int editorSaveAtomic(const char *path, struct bufferSnapshot *snapshot, mode_t mask, size_t *progress) {
+    char *tempPath = malloc(strlen(path) + sizeof(".simpad-XXXXXX"));
+    if (tempPath == NULL) {
+        die("malloc");
+    }
+    sprintf(tempPath, "%s.simpad-XXXXXX", path);
+
+    // A new file gets the usual 0644 permissions (less the umask), and an existing one keeps its own
+    mode_t mode = 0644 & ~mask;
+    struct stat fileStat;
+    int exists = stat(path, &fileStat) == 0;
+    if (exists) {
+        mode = fileStat.st_mode & 07777;
+    }
 
-    // Copy the row below to the end of the contents of the row we deleted
-    memcpy(&row->chars[row->size], s, length);
-    row->size += length;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.changed++;
+    int newFile = mkstemp(tempPath);
+    if (newFile != -1) {
+        // Hand an existing file's owner and group on as well, as far as we are allowed to (keeping the group may
+        // still work when taking over the owner does not)
+        if (exists && (fileStat.st_uid != geteuid() || fileStat.st_gid != getegid())) {
+            if (fchown(newFile, fileStat.st_uid, fileStat.st_gid) == -1 && fchown(newFile, -1, fileStat.st_gid) == -1) {
+                // Not ours to give away; the file is saved under our own user instead
+            }
+        }
+        int source = editorOpenOriginal(path, snapshot->store);
+        if (fchmod(newFile, mode) != -1 && editorWriteSnapshot(newFile, snapshot, source, progress) != -1 &&
+            (E.durability == DURABILITY_NONE || fdatasync(newFile) != -1) &&
+            rename(tempPath, path) != -1) {
+            if (E.durability == DURABILITY_FULL) {
+                editorSyncDirectory(path);
+            }
+        }
+        else {
+            int error = errno;
+            unlink(tempPath);
+            close(newFile);
+            newFile = -1;
+            errno = error;
+        }
+    }
+    free(tempPath);
+    return newFile;
 }
 
-void editorRowDeleteCharacter(editorRow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.changed++;
+// Bytes being written over a file in place, gathered a bufferful at a time. Front to back a buffer fills
+// from its start, and back to front from its end. The writes never overlap, and each one only covers bytes that
+// have already been copied out, so they can all be in flight at once
+struct tailWriter {
+    struct ioWriter io;
+    struct ioBatch *batch; // The buffer being filled
+    int backward;
+    size_t used;
+    off_t position; // Where in the file the next bytes go (going backward, where the last ones written began)
+};
+
+void tailWriterOpen(struct tailWriter *writer, int fd, int backward, off_t position, size_t *progress) {
+    ioWriterOpen(&writer->io, fd, progress);
+    ioWriterUseBuffers(&writer->io);
+    writer->batch = ioWriterNext(&writer->io);
+    writer->backward = backward;
+    writer->used = 0;
+    writer->position = position;
 }
 
-/************ EDITOR OPERATIONS ************/
+void tailWriterFlush(struct tailWriter *writer) {
+    struct ioBatch *batch = writer->batch;
+    off_t offset = writer->backward ? writer->position - (off_t)writer->used : writer->position;
 
-void editorInsertCharacter(int c) {
-    if (E.cursorY == E.numRows) {
-        editorInsertRow(E.numRows, "", 0);
+    batch->iov[0].iov_base = writer->backward ? &batch->buffer[SIMPAD_SAVE_BUFFER - writer->used] : batch->buffer;
+    batch->iov[0].iov_len = writer->used;
+    batch->count = 1;
+    batch->length = writer->used;
+    ioWriterSubmit(&writer->io, batch, offset);
+
+    writer->position = writer->backward ? offset : offset + (off_t)writer->used;
+    writer->used = 0;
+    writer->batch = ioWriterNext(&writer->io);
+}
+
+// Add bytes to the writer; going backward they are added in front of what is already there
+void tailWriterAdd(struct tailWriter *writer, const char *bytes, size_t length) {
+    while (length > 0) {
+        if (writer->used == SIMPAD_SAVE_BUFFER) tailWriterFlush(writer);
+        char *buffer = writer->batch->buffer;
+        size_t take = SIMPAD_SAVE_BUFFER - writer->used;
+        if (take > length) take = length;
+
+        if (writer->backward) {
+            memcpy(&buffer[SIMPAD_SAVE_BUFFER - writer->used - take], &bytes[length - take], take);
+        }
+        else {
+            memcpy(&buffer[writer->used], bytes, take);
+            bytes += take;
+        }
+        writer->used += take;
+        length -= take;
     }
-    editorRowInsertCharacter(&E.row[E.cursorY], E.cursorX, c);
-    E.cursorX++;
 }
 
-void editorInsertNewline() {
-    // If we are at the beginning of a line
-    if (E.cursorX == 0){
-        editorInsertRow(E.cursorY, "", 0);
+// Write out what is left and wait for every write. Returns -1 if any of them failed
+int tailWriterFinish(struct tailWriter *writer) {
+    if (writer->used > 0) tailWriterFlush(writer);
+    return ioWriterFinish(&writer->io);
+}
+
+// Work out whether a save can write only what comes after the first byte that changed, over the file as it is.
+// That needs the file to be the one the buffer was loaded from, untouched since, with its first bytes already where
+// they belong. Rows further on may still be read out of the mapping of the file being written, so the bytes are
+// copied out before they are overwritten: when text has only moved later in the file it is written back to front,
+// when it has only moved earlier front to back (an edit in one place moves everything after it the same way).
+//
+// Rewriting a file in place is not crash-safe, so unless durability is turned off this is only done to append,
+// which never touches a byte that is already on disk. Has to be called before the rows change again
+void editorPlanSave(const char *path, struct bufferSnapshot *snapshot, struct savePlan *plan) {
+    struct pieceStore *store = snapshot->store;
+    struct stat fileStat;
+    memset(plan, 0, sizeof(struct savePlan));
+    if (stat(path, &fileStat) == -1 || !S_ISREG(fileStat.st_mode) || !editorSameFile(&fileStat, &store->origStat) ||
+        (size_t)fileStat.st_size != store->origSize) {
+        return;
     }
-    else {
-        editorRow *row = &E.row[E.cursorY];
-        editorInsertRow(E.cursorY + 1, &row->chars[E.cursorX], row->size - E.cursorX); // Pass characters in the current row right of the cursor
-        row = &E.row[E.cursorY]; // Reassign pointer
-        row->size = E.cursorX; // Truncate the row we are on to where the cursor is
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+
+    size_t from = E.dirtyFrom < snapshot->bytes ? E.dirtyFrom : snapshot->bytes;
+    if (from > store->origSize) return;
+    if (from < store->origSize && E.durability != DURABILITY_NONE) return;
+
+    // The rows before the first changed one are as they were loaded; they are where they belong in the file as long
+    // as the last of them sits at its own offset with a newline after it (none of them lost a carriage return)
+    size_t column;
+    int64_t line = editorLineAtOffset(from, &column);
+    struct snapshotCursor cursor = {NULL, 0, NULL, 0, 0};
+    if (line > 0) {
+        snapshotSeek(&cursor, snapshot, line - 1);
+        struct rowPiece previous = snapshotRow(&cursor);
+        size_t previousEnd = from - column - 1;
+        if (previous.chars != store->orig + previousEnd - previous.size || store->orig[previousEnd] != '\n') {
+            snapshotCursorFree(&cursor);
+            return;
+        }
     }
-    E.cursorY++;
-    E.cursorX = 0; // Move cursor down a line to the start
-}
 
-void editorDeleteCharacter() {
-    if (E.cursorY == E.numRows) return; // If the cursor is past the end of the file, nothing to delete
-    if (E.cursorX == 0 && E.cursorY == 0) return; // If the cursor is at the beginning of the first line, do nothing
+    // Work out which way the text that is still in the original buffer has moved
+    int later = 0, earlier = 0;
+    size_t offset = from;
+    for (snapshotSeek(&cursor, snapshot, line); cursor.line < snapshot->numRows; snapshotNext(&cursor)) {
+        struct rowPiece piece = snapshotRow(&cursor);
+        size_t skip = cursor.line == line ? column : 0;
+        const char *chars = piece.chars + skip;
+        size_t size = piece.size - skip;
+        if (chars >= store->orig && chars < store->orig + store->origSize) {
+            size_t source = chars - store->orig;
+            if (offset > source) later = 1;
+            if (offset < source) earlier = 1;
+        }
+        offset += size + 1;
+    }
+    snapshotCursorFree(&cursor);
+    if (later && earlier) return;
+
+    plan->incremental = 1;
+    plan->backward = later;
+    plan->from = from;
+    plan->line = line;
+    plan->column = column;
+}
 
-    editorRow *row = &E.row[E.cursorY]; // get the row the cursor is on
-    if (E.cursorX > 0){
-        editorRowDeleteCharacter(row, E.cursorX - 1); // if there is a character to the left, delete it
-        E.cursorX--;
+// Write the part of a snapshot from plan->from on over the file. Returns the file, still open
+int editorSaveIncremental(const char *path, struct bufferSnapshot *snapshot, struct savePlan *plan, size_t *progress) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) return -1;
+    off_t position = plan->backward ? (off_t)snapshot->bytes : (off_t)plan->from;
+    struct tailWriter writer;
+    tailWriterOpen(&writer, fd, plan->backward, position, progress);
+
+    struct snapshotCursor cursor = {NULL, 0, NULL, 0, 0};
+    if (plan->backward) {
+        for (snapshotSeek(&cursor, snapshot, snapshot->numRows - 1); cursor.line >= plan->line && !writer.io.error; snapshotPrevious(&cursor)) {
+            struct rowPiece piece = snapshotRow(&cursor);
+            size_t skip = cursor.line == plan->line ? plan->column : 0;
+            tailWriterAdd(&writer, "\n", 1);
+            tailWriterAdd(&writer, piece.chars + skip, piece.size - skip);
+        }
     }
-    // If the cursor is at the start of a line 
     else {
-        E.cursorX = E.row[E.cursorY - 1].size;
-        editorRowAppendString(&E.row[E.cursorY - 1], row->chars, row->size); // row points to the row we delete, so we append row->chars to the previous row, then delete it
-        editorDeleteRow(E.cursorY);
-        E.cursorY--;
+        for (snapshotSeek(&cursor, snapshot, plan->line); cursor.line < snapshot->numRows && !writer.io.error; snapshotNext(&cursor)) {
+            struct rowPiece piece = snapshotRow(&cursor);
+            size_t skip = cursor.line == plan->line ? plan->column : 0;
+            tailWriterAdd(&writer, piece.chars + skip, piece.size - skip);
+            tailWriterAdd(&writer, "\n", 1);
+        }
     }
+    snapshotCursorFree(&cursor);
+    int failed = tailWriterFinish(&writer) == -1 || ftruncate(fd, (off_t)snapshot->bytes) == -1 ||
+                 (E.durability != DURABILITY_NONE && fdatasync(fd) == -1);
+
+    if (failed) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
 }
 
-/************ FILE INPUT/OUTPUT ************/
-
-char *editorRowsToString(int *bufferLen) {
-    int totalLen = 0;
-    int i;
-    // Add up the length of each row, so we know how much memory to allocate
-    for (i = 0; i < E.numRows; i++) {
-        totalLen += E.row[i].size + 1;
+int editorSaveRun(const char *path, struct bufferSnapshot *snapshot, struct savePlan *plan, mode_t mask, size_t *progress) {
+    if (plan->incremental) {
+        return editorSaveIncremental(path, snapshot, plan, progress);
     }
-    *bufferLen = totalLen;
+    return editorSaveAtomic(path, snapshot, mask, progress);
+}
 
-    char *buffer = malloc(totalLen);
-    char *p = buffer;
+void *editorSaveThread(void *argument) {
+    struct backgroundSave *save = argument;
+    save->fd = editorSaveRun(save->path, save->snapshot, &save->plan, save->umask, &save->written);
+    save->error = errno;
+    __atomic_store_n(&save->done, 1, __ATOMIC_RELEASE); // Everything above is seen by whoever sees this
+    return NULL;
+}
 
-    for (i = 0; i < E.numRows; i++){
-        memcpy(p, E.row[i].chars, E.row[i].size);
-        p += E.row[i].size;
-        *p = '\n';
-        p++;
+// Wrap up a save, on the main thread. If nothing was edited while it ran, the rows move over to the file just
+// written; otherwise they keep to the old one (a replaced file lives on while mapped, and appending leaves the
+// bytes already there alone)
+void editorSaveComplete(struct backgroundSave *save) {
+    // Let go of the snapshot first, so that the rows are no longer shared with it when they are pointed at the file
+    size_t bytes = save->snapshot->bytes;
+    editorSnapshotRelease(save->snapshot);
+    save->snapshot = NULL;
+
+    if (save->fd != -1) {
+        if (!editorIsDirty() && !E.window.active) {
+            editorRebaseRows(save->fd, bytes, 0);
+        }
+        else if (!editorIsDirty() && save->windowGeneration == E.window.generation) {
+            editorWindowRebase(save->fd, bytes); // Rows paged in since may not be laid out as saved
+        }
+        if (E.follow.active) {
+            editorFollowStart(save->path, bytes, 0); // The file followed is now the one just written
+        }
+        else if (!E.follow.enabled) {
+            // The file on disk is now what was saved, so that is what outside changes are measured against
+            if (E.watch.inotify == -1) {
+                editorWatchStart(save->path);
+            }
+            else if (E.watch.hashes.store != E.store) {
+                editorHashStart(save->path);
+            }
+            fstat(save->fd, &E.watch.known);
+            E.watch.changed = 0;
+            E.watch.overwrite = 0;
+        }
+        editorJournalRebase(save);
+        close(save->fd);
+        size_t written = save->plan.incremental ? bytes - save->plan.from : bytes;
+        editorSetStatusMessage("%zu bytes written to disk", written); // Status bar will now display whether we succesfully saved or not
     }
-
-    return buffer;
+    else {
+        editorMarkDirty(save->dirtyFrom); // The changes that were being saved are still unsaved
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(save->error));
+    }
+    free(save->path);
+    save->active = 0;
 }
 
-// Responsible for opening and reading a file 
-void editorOpen(char *fileName) {
-    free(E.fileName);
-    E.fileName = strdup(fileName);
-
-    editorSelectSyntaxHighlight();
+// Check on a save running in the background: report how far it has got, or finish it off when it is done
+int editorSavePoll() {
+    struct backgroundSave *save = &E.save;
+    if (!save->active) return 0;
 
-    FILE *filePointer = fopen(fileName, "r");
-    if (!filePointer) {
-        die("fopen");
+    if (!__atomic_load_n(&save->done, __ATOMIC_ACQUIRE)) {
+        size_t written = __sync_add_and_fetch(&save->written, 0);
+        size_t total = save->plan.incremental ? save->snapshot->bytes - save->plan.from : save->snapshot->bytes;
+        editorSetStatusMessage("Saving... %d%%", total ? (int)(written * 100 / total) : 100);
+        return 1;
     }
-    char *line = NULL;
-    size_t lineCap = 0;
-    ssize_t lineLength;
+    pthread_join(save->thread, NULL);
+    editorSaveComplete(save);
+    return 1;
+}
 
-    while ((lineLength = getline(&line, &lineCap, filePointer)) != -1){
-        while (lineLength > 0 && (line[lineLength - 1] == '\n' || 
-                                  line[lineLength - 1] == '\r')) {
-            lineLength--;
-        }
-        editorInsertRow(E.numRows, line, lineLength);
-    }
-    free(line);
-    fclose(filePointer);
-    E.changed = 0;
+// Wait for a save in the background to finish (before quitting, or saving again)
+void editorSaveFinish() {
+    struct backgroundSave *save = &E.save;
+    if (!save->active) return;
+    pthread_join(save->thread, NULL);
+    editorSaveComplete(save);
 }
 
 void editorSave() {
@@ -718,40 +5166,88 @@ void editorSave() {
         editorSelectSyntaxHighlight();
     } 
 
-    int length;
-    char *buffer = editorRowsToString(&length);
+    // Saving over a change made from outside (which could not be taken in, as the buffer has edits) needs asking for twice
+    if (E.watch.changed && !E.watch.overwrite) {
+        E.watch.overwrite = 1;
+        editorSetStatusMessage("WARNING - File changed on disk since it was opened. Press Ctrl-S again to overwrite it.");
+        return;
+    }
 
-    // Create a new file and open it (O_CREAT) for reading and writing (O_RDRW) - 0644 is the permissions flag, giving the owner full permission over the file, while every other user can only read the file.
-    int newFile = open(E.fileName, O_RDWR | O_CREAT, 0644);
+    editorSaveFinish(); // One save at a time
+    editorLoadFinish(); // Only save once the whole file is there to save
+
+    struct backgroundSave *save = &E.save;
+    memset(save, 0, sizeof(struct backgroundSave));
+    save->snapshot = E.window.active ? editorWindowSnapshot() : editorSnapshotTake();
+    save->windowGeneration = E.window.generation;
+    save->umask = E.umask;
+    editorJournalFlush(); // Records from here on are of edits made to what is being saved
+    save->journalMark = E.journal.length;
+
+    // Save through any symlink, rather than replacing it
+    save->path = realpath(E.fileName, NULL);
+    if (save->path == NULL) {
+        save->path = strdup(E.fileName);
+    }
+    if (!E.window.active) {
+        editorPlanSave(save->path, save->snapshot, &save->plan); // In windowed mode the file is always written anew
+    }
 
-    if (newFile != -1){
-        if (ftruncate(newFile, length) != -1) {
-            if (write(newFile, buffer, length) == length) {
-                close(newFile);
-                free(buffer);
-                E.changed = 0;
-                editorSetStatusMessage("%d bytes written to disk", length); // Status bar will now display whether we succesfully saved or not
-                return;
-            }
-        }
-        close(newFile);
+    // From here on, anything edited is relative to what is being saved
+    save->dirtyFrom = E.dirtyFrom;
+    E.dirtyFrom = SIZE_MAX;
+    save->active = 1;
+
+    // Writing over the file in place changes the mapping the rows are read from, so that cannot go on while
+    // editing does. Anything else is written from the snapshot on its own thread
+    int inPlace = save->plan.incremental && save->plan.from < save->snapshot->store->origSize;
+    if (inPlace || pthread_create(&save->thread, NULL, editorSaveThread, save) != 0) {
+        editorSaveThread(save);
+        editorSaveComplete(save);
+        return;
     }
-    free(buffer);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    editorSetStatusMessage("Saving...");
 }
 
 /************ SEARCH FEATURE ***********/
 
 void editorFindCallback(char *query, int key){
 
-    static int lastMatch = -1; // The prior search result (-1 if no result, or index of the last match row)
+    static int64_t lastMatch = -1; // The prior search result (-1 if no result, or index of the last match row)
     static int direction = 1;  // 1 = down, -1 = up
 
-    static int savedHighlightedLine; // Which line needs to be restored
+    static int64_t savedHighlightedLine; // Which line needs to be restored
     static char *savedHighlight = NULL;
+    static int64_t savedHighlightSize;
+
+    // The file may have been reloaded (or reopened, when followed) since the last match, taking its row with it
+    static unsigned long savedGeneration;
+    if (lastMatch != -1 && savedGeneration != E.rowsGeneration) {
+        lastMatch = -1;
+        free(savedHighlight);
+        savedHighlight = NULL;
+    }
+
+    // In windowed mode rows may have paged in or out above the match since, which moves its row number
+    static int64_t savedShift, savedJumps;
+    if (E.window.active && lastMatch != -1) {
+        if (savedJumps != E.window.jumps) {
+            lastMatch = -1; // The row is gone, and its highlight with it
+            free(savedHighlight);
+            savedHighlight = NULL;
+        }
+        else {
+            lastMatch += E.window.shift - savedShift;
+            savedHighlightedLine += E.window.shift - savedShift;
+            savedShift = E.window.shift;
+        }
+    }
 
     if (savedHighlight) {
-        memcpy(E.row[savedHighlightedLine].highlight, savedHighlight, E.row[savedHighlightedLine].renderSize);
+        editorRow *savedRow = editorRowAt(savedHighlightedLine);
+        if (savedRow && savedRow->highlight && savedRow->renderSize == savedHighlightSize) {
+            memcpy(savedRow->highlight, savedHighlight, savedRow->renderSize);
+        }
         free(savedHighlight);
         savedHighlight = NULL;
     }
@@ -774,32 +5270,63 @@ void editorFindCallback(char *query, int key){
     if (lastMatch == -1) {
         direction = 1;
     }
-    int current = lastMatch; // Current is the index of the row we are searching 
-    int i;
+    int64_t current = lastMatch; // Current is the index of the row we are searching 
+    editorRow *row = (lastMatch == -1) ? NULL : editorRowAt(lastMatch);
+    int64_t i;
 
-    for (i = 0; i < E.numRows; i++){
+    // Windowed mode takes a step more, off the end of the window into the rest of the file
+    for (i = 0; i < E.numRows + E.window.active; i++){
         current += direction;
-        if (current == -1){
-            current = E.numRows - 1;
-        }
-        else if (current == E.numRows){
-            current = 0;
+        const char *chars;
+        const char *match;
+
+        // In windowed mode the rest of the file is searched before wrapping round to the other end of the window
+        if ((current == -1 || current == E.numRows) && E.window.active && editorWindowFind(query, direction)) {
+            current = E.cursorY;
+            row = editorRowAt(current);
+            chars = editorRowChars(row);
+            match = &chars[E.cursorX];
         }
+        else {
+            if (current == -1){
+                current = E.numRows - 1;
+                row = NULL;
+            }
+            else if (current == E.numRows){
+                current = 0;
+                row = NULL;
+            }
+            // Step to the neighbouring row, and only look one up when starting out or wrapping around
+            if (row) {
+                row = (direction == 1) ? editorRowNext(row) : editorRowPrevious(row);
+            }
+            else {
+                row = editorRowAt(current);
+            }
 
-        editorRow *row = &E.row[current];
-        char *match = strstr(row->render, query);
+            // Search the chars rather than the render, so rows that were never drawn do not have to be rendered
+            chars = editorRowChars(row);
+            match = memmem(chars, row->size, query, strlen(query));
+        }
 
         if (match){
             lastMatch = current;
+            savedGeneration = E.rowsGeneration;
+            savedShift = E.window.shift;
+            savedJumps = E.window.jumps;
             E.cursorY = current;
-            E.cursorX = editorRowRenderXToCursorX(row, match - row->render);
+            E.cursorX = match - chars;
             E.rowOffset = E.numRows;
 
             // Searched text using Ctrl+F is now highlighted
+            editorRowMaterialize(row);
+            int64_t matchStart = editorRowCursorXToRenderX(row, E.cursorX);
+            int64_t matchEnd = editorRowCursorXToRenderX(row, E.cursorX + strlen(query));
             savedHighlightedLine = current;
+            savedHighlightSize = row->renderSize;
             savedHighlight = malloc(row->renderSize);
             memcpy(savedHighlight, row->highlight, row->renderSize);
-            memset(&row->highlight[match - row->render], HIGHLIGHT_MATCH, strlen(query));
+            memset(&row->highlight[matchStart], HIGHLIGHT_MATCH, matchEnd - matchStart);
             break;
         }
     }
@@ -807,10 +5334,10 @@ void editorFindCallback(char *query, int key){
 
 void editorFind() {
 
-    int savedCursorX = E.cursorX;
-    int savedCursorY = E.cursorY;
-    int savedColOffset = E.colOffset;
-    int savedRowOffset = E.rowOffset;
+    int64_t savedCursorX = E.cursorX;
+    int64_t savedCursorY = E.cursorY;
+    int64_t savedColOffset = E.colOffset;
+    int64_t savedRowOffset = E.rowOffset;
 
     char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
     if (query) {
@@ -825,6 +5352,39 @@ void editorFind() {
     }
 }
 
+/************ GO TO OFFSET ************/
+
+// Byte offset of the cursor in the file as it would be saved
+size_t editorCursorOffset() {
+    size_t start = E.window.active ? editorWindowStartBytes() : 0;
+    if (E.cursorY >= E.numRows) return start + rowTreeBytes(E.rows);
+    return start + editorRowOffset(editorRowAt(E.cursorY)) + E.cursorX;
+}
+
+void editorGotoOffset() {
+    char *query = editorPrompt("Go to byte offset: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+
+    char *end;
+    errno = 0;
+    unsigned long long offset = strtoull(query, &end, 10);
+    if (*end != '\0' || errno == ERANGE || query[0] == '-') {
+        editorSetStatusMessage("Not a byte offset: %s", query);
+        free(query);
+        return;
+    }
+    free(query);
+
+    if (E.window.active) {
+        editorWindowJump(offset);
+        return;
+    }
+    editorLoadFinish(); // The offset may be in the part of the file still loading
+    size_t column;
+    E.cursorY = editorLineAtOffset(offset, &column);
+    E.cursorX = column;
+}
+
 /************ APPEND BUFFER ************/
 
 struct abuf {
@@ -859,7 +5419,7 @@ void bufferFree(struct abuf *ab){
 void editorScroll() {
     E.renderX = 0;
     if (E.cursorY < E.numRows) {
-        E.renderX = editorRowCursorXToRenderX(&E.row[E.cursorY], E.cursorX);
+        E.renderX = editorRowCursorXToRenderX(editorRowAt(E.cursorY), E.cursorX);
     }
 
     // Above the visible window?
@@ -878,12 +5438,14 @@ void editorScroll() {
     if (E.renderX >= E.colOffset + E.termCols){
         E.colOffset = E.renderX - E.termCols + 1;
     }
+    editorWindowScroll();
 }
 
 void editorDrawRows(struct abuf *ab) {
     int x;
+    editorRow *row = editorRowAt(E.rowOffset);
     for (x=0; x<E.termRows; x++){
-        int fileRow = x + E.rowOffset;
+        int64_t fileRow = x + E.rowOffset;
         if (fileRow >= E.numRows) {
             // The welcome message will only display if our text buffer is empty
             if (E.numRows == 0 && x == E.termRows / 3) {
@@ -910,16 +5472,17 @@ void editorDrawRows(struct abuf *ab) {
             }
         }
         else {
+            editorRowMaterialize(row);
             // Check if we are drawing a row that is part of the text buffer, or a row that comes after the text buffer
-            int len = E.row[fileRow].renderSize - E.colOffset;
+            int64_t len = row->renderSize - E.colOffset;
             if (len < 0) {
                 len = 0;
             }
             if (len > E.termCols) {
                 len = E.termCols;
             }
-            char *c = &E.row[fileRow].render[E.colOffset];
-            unsigned char *highlight = &E.row[fileRow].highlight[E.colOffset];
+            const char *c = &row->render[E.colOffset];
+            unsigned char *highlight = &row->highlight[E.colOffset];
             int currentColor = -1;
 
             // Cannot simply feed render substring to print into bufferAppend()
@@ -960,6 +5523,7 @@ void editorDrawRows(struct abuf *ab) {
                 }
             }
             bufferAppend(ab, "\x1b[39m", 5);
+            row = editorRowNext(row);
         }
         bufferAppend(ab, "\x1b[K", 3);
         bufferAppend(ab, "\r\n", 2);
@@ -969,8 +5533,32 @@ void editorDrawRows(struct abuf *ab) {
 void editorDrawStatusBar(struct abuf *ab){
     bufferAppend(ab, "\x1b[7m", 4);
     char status[80], renderStatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.fileName ? E.fileName : "[No Name]", E.numRows, E.changed ? "(modified)" : "");
-    int renderLen = snprintf(renderStatus, sizeof(renderStatus), "%s | %d/%d", E.syntax ? E.syntax->fileType : "no filetype", E.cursorY + 1, E.numRows); // Current line number
+    char loading[24] = "";
+    if (E.loader.active) {
+        snprintf(loading, sizeof(loading), " (loading %d%%)", editorLoadProgress()); // The line count is still growing
+    }
+    else if (E.stream.active) {
+        snprintf(loading, sizeof(loading), " (reading stdin)");
+    }
+    else if (E.follow.active) {
+        snprintf(loading, sizeof(loading), " (following)");
+    }
+
+    // In windowed mode line numbers are only known once the lines before them have been counted
+    char lines[24] = "?", line[24] = "?";
+    int64_t totalLines = E.numRows, firstLine = 0;
+    if (E.window.active) {
+        totalLines = editorWindowTotalLines();
+        firstLine = editorWindowFirstLine();
+        if (E.window.checkpoints.running) {
+            snprintf(loading, sizeof(loading), " (counting %d%%)", editorCheckpointProgress());
+        }
+    }
+    if (totalLines >= 0) snprintf(lines, sizeof(lines), "%" PRId64, totalLines);
+    if (firstLine >= 0) snprintf(line, sizeof(line), "%" PRId64, firstLine + E.cursorY + 1);
+
+    int len = snprintf(status, sizeof(status), "%.20s - %s lines%s %s", E.fileName ? E.fileName : "[No Name]", lines, loading, editorIsDirty() ? "(modified)" : "");
+    int renderLen = snprintf(renderStatus, sizeof(renderStatus), "%s | byte %zu | %s/%s", E.syntax ? E.syntax->fileType : "no filetype", editorCursorOffset(), line, lines); // Current byte offset and line number
     // If the status string is too long, cut it short
     if (len > E.termCols) {
         len = E.termCols;
@@ -1022,7 +5610,7 @@ void editorRefreshScreen() {
 
     // Convert the text cursor position to 1-indexed values
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursorY - E.rowOffset) + 1, (E.renderX - E.colOffset) + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(E.cursorY - E.rowOffset) + 1, (int)(E.renderX - E.colOffset) + 1);
     bufferAppend(&ab, buf, strlen(buf));
 
     bufferAppend(&ab, "\x1b[?25h", 6);
@@ -1042,6 +5630,13 @@ void editorSetStatusMessage(const char *formatString, ...) {
 
 /************ INPUT ************/
 
+// Called while waiting for a key: finish off whatever work is going on in the background.
+// Returns whether anything changed that should be drawn
+int editorPoll() {
+    return editorLoadPoll() | editorStreamPoll() | editorFollowPoll() | editorWatchPoll() | editorSavePoll() | editorCheckpointPoll() |
+           editorJournalPoll() | editorMapPoll();
+}
+
 // Prompts the user to input a filename when saving a new file 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) { 
     size_t bufferSize = 128;
@@ -1091,7 +5686,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 // Grant control of the mouse cursor using WASD (Will change to arrow keys later)
 // Establish bounds that prevent the cursor from moving off the screen
 void editorMoveCursor(int key) {
-    editorRow *row = (E.cursorY >= E.numRows) ? NULL : &E.row[E.cursorY];
+    editorRow *row = (E.cursorY >= E.numRows) ? NULL : editorRowAt(E.cursorY);
 
     switch (key) {
         case ARROW_LEFT:
@@ -1099,7 +5694,7 @@ void editorMoveCursor(int key) {
                 E.cursorX--;
             } else if (E.cursorY > 0) {
                 E.cursorY--;
-                E.cursorX = E.row[E.cursorY].size;
+                E.cursorX = editorRowAt(E.cursorY)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -1118,8 +5713,8 @@ void editorMoveCursor(int key) {
             break;
     }
     // If at the last position in a line, snap to the end of the next line if we change rows
-    row = (E.cursorY >= E.numRows) ? NULL : &E.row[E.cursorY];
-    int rowLength = row ? row->size : 0;
+    row = (E.cursorY >= E.numRows) ? NULL : editorRowAt(E.cursorY);
+    int64_t rowLength = row ? row->size : 0;
     if (E.cursorX > rowLength){
         E.cursorX = rowLength;
     }
@@ -1137,11 +5732,13 @@ void editorProcessKeypress() {
             break;
         // command + q to quit
         case CTRL_KEY('q'):
-            if (E.changed && quit_times > 0) {
+            editorSaveFinish(); // Never leave a save half written
+            if (editorIsDirty() && quit_times > 0) {
                 editorSetStatusMessage("WARNING - File has unsaved changes. Press Ctrl-Q again to quit.");
                 quit_times--;
                 return;
             }
+            editorJournalClose(1); // Quitting on purpose, so there is nothing to recover
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1159,7 +5756,7 @@ void editorProcessKeypress() {
         // Use Fn + right arrow to bring cursor to end of line
         case END_KEY:
             if (E. cursorY < E.numRows) {
-                E.cursorX = E.row[E.cursorY].size;
+                E.cursorX = editorRowAt(E.cursorY)->size;
             }
             break;
 
@@ -1167,6 +5764,11 @@ void editorProcessKeypress() {
         case CTRL_KEY('f'):
             editorFind();
             break;
+
+        // Jump to a byte offset in the file
+        case CTRL_KEY('g'):
+            editorGotoOffset();
+            break;
         
         case BACKSPACE:
         case CTRL_KEY('h'):
@@ -1228,27 +5830,92 @@ void initEditor() {
     E.rowOffset = 0; // Scroll to top of file by default
     E.colOffset = 0;
     E.numRows = 0;
-    E.row = NULL;
-    E.changed = 0; // Flag that tells us if a file has been changed since its last save
+    E.rows = NULL;
+    E.rowChunks = NULL;
+    E.freeRows = NULL;
+    E.retiredRows = NULL;
+    E.rowCapacity = 0;
+    E.treeVersion = 0;
+    E.sharedSnapshots = 0;
+    E.store = pieceStoreNew();
+    E.mapFaults = 0;
+    E.mapFaultsSeen = 0;
+    editorMapGuard();
+    E.gap.row = NULL;
+    E.gap.buffer = NULL;
+    E.gap.capacity = 0;
+    memset(&E.arena, 0, sizeof(E.arena));
+    E.follow.inotify = -1;
+    E.follow.fd = -1;
+    E.watch.inotify = -1;
+    E.dirtyFrom = SIZE_MAX; // Nothing has changed since the file was opened or last saved
+    E.rowsGeneration = 0;
     E.fileName = NULL;
     E.statusMsg[0] = '\0';
     E.statusMsg_time = 0;
     E.syntax = NULL; // When NULL, there is no filetype, and hence no syntax highlighting
 
+    // Saves sync everything unless told otherwise
+    char *durability = getenv("SIMPAD_DURABILITY");
+    E.durability = DURABILITY_FULL;
+    E.umask = umask(0);
+    umask(E.umask);
+    if (durability && !strcmp(durability, "none")) E.durability = DURABILITY_NONE;
+    else if (durability && !strcmp(durability, "data")) E.durability = DURABILITY_DATA;
+
     if (getWindowSize(&E.termRows, &E.termCols) == -1) {
         die("getWindowSize");
     }
     E.termRows -= 2; // Make space for a status bar + status message
 }
 
+// Print the allocation and I/O counters when simpad exits, so we can measure what the row arena and io_uring save (set SIMPAD_STATS to enable)
+void editorPrintStats() {
+    struct arenaStats *stats = &E.arena.stats;
+    fprintf(stderr, "rows: %zu slots in %lu chunks\n", E.rowCapacity, stats->rowChunks);
+    fprintf(stderr, "arena: %lu allocations (%lu reused) from %lu slabs, %lu large allocations, %zu bytes in use\n",
+            stats->allocations, stats->reuses, stats->slabs, stats->large, stats->bytesInUse);
+    fprintf(stderr, "io: %lu pread, %lu pwritev, %lu copy_file_range, %lu io_uring_enter\n",
+            E.io.reads, E.io.writes, E.io.copies, E.io.enters);
+}
+
 int main(int argc, char *argv[]) {
+    E.mainThread = pthread_self();
+    // Registered before raw mode, so the counters are printed once the terminal has been restored
+    if (getenv("SIMPAD_STATS")) {
+        atexit(editorPrintStats);
+    }
+    // With - the text comes in on stdin, so keys have to be read from the terminal itself instead
+    int stream = -1;
+    if (argc >= 2 && !strcmp(argv[1], "-") && !isatty(STDIN_FILENO)) {
+        stream = dup(STDIN_FILENO);
+        int tty = open("/dev/tty", O_RDWR);
+        if (stream == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+            die("/dev/tty");
+        }
+        close(tty);
+    }
     enableRawMode();
     initEditor();
-    if (argc >= 2) {
+    if (stream != -1) {
+        editorOpenStream(stream);
+    }
+    else if (argc >= 3 && !strcmp(argv[1], "-r")) {
+        E.journal.recover = 1;
+        editorOpen(argv[2]);
+    }
+    else if (argc >= 3 && !strcmp(argv[1], "-f")) {
+        E.follow.enabled = 1;
+        editorOpen(argv[2]);
+        editorFollowPin(); // Start at the bottom, like tail -f
+    }
+    else if (argc >= 2 && strcmp(argv[1], "-")) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find");
+    if (E.statusMsg[0] == '\0') { // Anything opening the file had to say comes first
+        editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find | Ctrl-G = go to byte");
+    }
 
     while (1) {
         editorRefreshScreen();
@@ -0,0 +1,195 @@
+/************ INCLUDES ************/
+
+// A benchmark of file I/O with and without io_uring: it writes a file of lines, then reads it the way a file that is
+// not mapped is read (ioReadAll) and saves it with an edit every few lines (editorSaveAtomic, to a file of its own),
+// once with SIMPAD_IO=sync and once with the ring. It reports MB/s and the syscalls each took, and checks that both
+// read the same bytes and saved the same file. Run it with make bench-io
+//
+// simpad.c is built in, with its main renamed, so what is timed is the I/O simpad itself does
+#define main simpadMain
+#include "../simpad.c"
+#undef main
+
+/************ DEFINES ************/
+
+#define BENCH_SIZE (256 * 1024 * 1024) // Bytes in the file, unless a size in MB is given
+#define BENCH_RUNS 3 // Each way is timed this many times, and the best time kept
+#define BENCH_EDIT_EVERY 64 // A character is typed into every this many lines, so the save has pieces to gather
+
+/************ BENCHMARK ************/
+
+void fail(const char *format, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+void fail(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    fprintf(stderr, "bench-io: FAIL: ");
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+double benchNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Write size bytes of lines from 0 to 199 characters long, from a fixed sequence so every run uses the same file
+void makeFile(const char *path, size_t size) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) fail("%s: %s", path, strerror(errno));
+    uint32_t seed = 12345;
+    char line[256];
+    size_t i;
+    for (i = 0; i < sizeof(line); i++) line[i] = 'a' + i % 26;
+    size_t written = 0;
+    while (written < size) {
+        seed = seed * 1103515245 + 12345;
+        size_t length = (seed >> 16) % 200;
+        if (length > size - written - 1) length = size - written - 1;
+        char keep = line[length];
+        line[length] = '\n';
+        if (fwrite(line, 1, length + 1, fp) != length + 1) fail("%s: %s", path, strerror(errno));
+        line[length] = keep;
+        written += length + 1;
+    }
+    if (fclose(fp) != 0) fail("%s: %s", path, strerror(errno));
+}
+
+char *readFile(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat fileStat;
+    if (fd == -1 || fstat(fd, &fileStat) == -1) fail("%s: %s", path, strerror(errno));
+    *size = fileStat.st_size;
+    char *buffer = malloc(*size + 1);
+    if (buffer == NULL) fail("malloc");
+    if (ioReadSync(fd, buffer, *size, 0) != (ssize_t)*size) fail("%s: %s", path, strerror(errno));
+    close(fd);
+    return buffer;
+}
+
+void benchReport(const char *what, const char *mode, double seconds, size_t bytes, const struct ioStats *io) {
+    printf("bench-io: %-4s %-4s %8.3f s %9.1f MB/s  %lu pread, %lu pwritev, %lu copy_file_range, %lu io_uring_enter\n",
+           what, mode, seconds, bytes / seconds / (1024 * 1024), io->reads, io->writes, io->copies, io->enters);
+}
+
+// Read the whole file into a buffer of its own the way one too small to map is loaded, and return it
+char *benchRead(const char *path, size_t size, const char *mode) {
+    char *buffer = malloc(size + 1);
+    if (buffer == NULL) fail("malloc");
+    double best = 0;
+    struct ioStats io;
+    int run;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) fail("%s: %s", path, strerror(errno));
+        memset(&E.io, 0, sizeof(E.io));
+        double start = benchNow();
+        ssize_t bytesRead = ioReadAll(fd, buffer, size);
+        double elapsed = benchNow() - start;
+        io = E.io;
+        close(fd);
+        if (bytesRead != (ssize_t)size) fail("read %zd of %zu bytes (%s)", bytesRead, size, mode);
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    benchReport("read", mode, best, size, &io);
+    return buffer;
+}
+
+// Save the buffer to path, and return how big the saved file is
+size_t benchSave(const char *path, const char *mode) {
+    double best = 0;
+    struct ioStats io;
+    size_t progress = 0;
+    int run;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        struct bufferSnapshot *snapshot = editorSnapshotTake();
+        progress = 0;
+        memset(&E.io, 0, sizeof(E.io));
+        double start = benchNow();
+        int fd = editorSaveAtomic(path, snapshot, 022, &progress);
+        double elapsed = benchNow() - start;
+        io = E.io;
+        if (fd == -1) fail("saving %s (%s): %s", path, mode, strerror(errno));
+        close(fd);
+        editorSnapshotRelease(snapshot);
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    benchReport("save", mode, best, progress, &io);
+    return progress;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file to write> [size in MB]\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[1];
+    size_t size = argc > 2 ? (size_t)atol(argv[2]) * 1024 * 1024 : BENCH_SIZE;
+    if (size == 0) fail("bad size %s", argv[2]);
+    makeFile(path, size);
+    char *expected = readFile(path, &size);
+
+    // Load the file into rows, as simpad does, and type a character into every few lines
+    E.store = pieceStoreNew();
+    E.durability = DURABILITY_NONE; // What is timed is the writing, not the disk
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) fail("%s: %s", path, strerror(errno));
+    pieceStoreLoad(E.store, fd, size);
+    close(fd);
+    struct lineIndex index = {NULL, 0, 0, NULL};
+    editorScanLinesParallel(&index, E.store->orig, E.store->origSize);
+    editorInsertRows(0, index.lines, index.numLines);
+    free(index.lines);
+    int64_t line;
+    for (line = 0; line < E.numRows; line += BENCH_EDIT_EVERY) {
+        editorRowInsertCharacter(editorRowAt(line), 0, '#');
+    }
+    printf("bench-io: %zu bytes in %" PRId64 " lines, best of %d runs\n", size, E.numRows, BENCH_RUNS);
+
+    const char *modes[] = {"sync", "ring"};
+    char *buffers[2];
+    char *saved[2];
+    size_t savedSizes[2];
+    int mode;
+    for (mode = 0; mode < 2; mode++) {
+        if (mode == 0) {
+            setenv("SIMPAD_IO", "sync", 1);
+        }
+        else {
+            unsetenv("SIMPAD_IO");
+        }
+        buffers[mode] = benchRead(path, size, modes[mode]);
+        if (memcmp(buffers[mode], expected, size) != 0) fail("read (%s) is not the file", modes[mode]);
+
+        saved[mode] = malloc(strlen(path) + sizeof(".sync"));
+        if (saved[mode] == NULL) fail("malloc");
+        sprintf(saved[mode], "%s.%s", path, modes[mode]);
+        savedSizes[mode] = benchSave(saved[mode], modes[mode]);
+    }
+
+    // Both saves have to have written the very same file, of the right size
+    size_t expectedSize = size + (E.numRows + BENCH_EDIT_EVERY - 1) / BENCH_EDIT_EVERY;
+    size_t sizes[2];
+    char *contents[2];
+    for (mode = 0; mode < 2; mode++) {
+        contents[mode] = readFile(saved[mode], &sizes[mode]);
+        if (sizes[mode] != expectedSize || savedSizes[mode] != expectedSize) {
+            fail("%s is %zu bytes (%zu written), not %zu", saved[mode], sizes[mode], savedSizes[mode], expectedSize);
+        }
+    }
+    if (memcmp(contents[0], contents[1], expectedSize) != 0) fail("%s and %s differ", saved[0], saved[1]);
+
+    for (mode = 0; mode < 2; mode++) {
+        unlink(saved[mode]);
+        free(saved[mode]);
+        free(contents[mode]);
+        free(buffers[mode]);
+    }
+    free(expected);
+    unlink(path);
+    printf("bench-io: passed\n");
+    return 0;
+}
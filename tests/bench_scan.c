@@ -0,0 +1,176 @@
+/************ INCLUDES ************/
+
+// A benchmark of the line scanner: it writes a file of lines of mixed lengths, then times splitting it into lines
+// with each vector scanner the CPU has, with the byte at a time fallback and with a getline loop (the way files
+// used to be read), and checks they all find the same number of lines. Run it with make bench-scan
+//
+// simpad.c is built in, with its main renamed, so what is timed is the scanners simpad itself uses
+#define main simpadMain
+#include "../simpad.c"
+#undef main
+
+/************ DEFINES ************/
+
+#define BENCH_SIZE (256 * 1024 * 1024) // Bytes in the file, unless a size in MB is given
+#define BENCH_RUNS 3 // Each way is timed this many times, and the best time kept
+
+/************ BENCHMARK ************/
+
+void fail(const char *format, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+void fail(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    fprintf(stderr, "bench-scan: FAIL: ");
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+double benchNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Write size bytes of lines from 0 to 199 characters long, some of them ending in \r\n. The lengths come from a
+// fixed sequence, so every run scans the same file
+void makeFile(const char *path, size_t size) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) fail("%s: %s", path, strerror(errno));
+    uint32_t seed = 12345;
+    char line[256];
+    memset(line, 'a', sizeof(line));
+    size_t written = 0;
+    while (written < size) {
+        seed = seed * 1103515245 + 12345;
+        size_t length = (seed >> 16) % 200;
+        if (length > size - written - 1) length = size - written - 1;
+        int crlf = (seed >> 8) % 16 == 0 && length > 0;
+        if (crlf) line[length - 1] = '\r';
+        line[length] = '\n';
+        if (fwrite(line, 1, length + 1, fp) != length + 1) fail("%s: %s", path, strerror(errno));
+        line[length] = 'a';
+        if (crlf) line[length - 1] = 'a';
+        written += length + 1;
+    }
+    if (fclose(fp) != 0) fail("%s: %s", path, strerror(errno));
+}
+
+char *readFile(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat fileStat;
+    if (fd == -1 || fstat(fd, &fileStat) == -1) fail("%s: %s", path, strerror(errno));
+    *size = fileStat.st_size;
+    char *buffer = malloc(*size);
+    if (buffer == NULL) fail("malloc");
+    if (ioReadSync(fd, buffer, *size, 0) != (ssize_t)*size) fail("%s: %s", path, strerror(errno));
+    close(fd);
+    return buffer;
+}
+
+// The ways of splitting the buffer into lines being compared
+enum benchScanner {
+    BENCH_AVX2,
+    BENCH_SSE2,
+    BENCH_SCALAR,
+    BENCH_GETLINE
+};
+
+// Split the file into lines one way, and count them
+int64_t benchScan(enum benchScanner scanner, const char *path, const char *buffer, size_t size) {
+    struct lineIndex index = {NULL, 0, 0, NULL};
+    size_t i = 0;
+    index.lineStart = buffer;
+
+    switch (scanner) {
+#ifdef SIMPAD_X86_SIMD
+        case BENCH_AVX2:
+            i = scanNewlinesAVX2(buffer, size, &index);
+            break;
+        case BENCH_SSE2:
+            i = scanNewlinesSSE2(buffer, size, &index);
+            break;
+#else
+        case BENCH_AVX2:
+        case BENCH_SSE2:
+            break;
+#endif
+        case BENCH_SCALAR:
+            break;
+        case BENCH_GETLINE: {
+            // A line at a time from the file (in the page cache by now), cutting the line ending off each
+            FILE *fp = fopen(path, "r");
+            if (fp == NULL) fail("%s: %s", path, strerror(errno));
+            char *line = NULL;
+            size_t lineCapacity = 0;
+            ssize_t lineLength;
+            int64_t lines = 0;
+            while ((lineLength = getline(&line, &lineCapacity, fp)) != -1) {
+                while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r')) {
+                    lineLength--;
+                }
+                lines++;
+            }
+            free(line);
+            fclose(fp);
+            return lines;
+        }
+    }
+    scanNewlinesScalar(buffer, i, size, &index);
+    if (index.lineStart < buffer + size) {
+        lineIndexEnd(&index, buffer + size);
+    }
+    free(index.lines);
+    return index.numLines;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file to write> [size in MB]\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[1];
+    size_t size = argc > 2 ? (size_t)atol(argv[2]) * 1024 * 1024 : BENCH_SIZE;
+    if (size == 0) fail("bad size %s", argv[2]);
+    makeFile(path, size);
+    char *buffer = readFile(path, &size);
+
+    const char *names[] = {"avx2", "sse2", "scalar", "getline"};
+    int supported[] = {0, 0, 1, 1};
+#ifdef SIMPAD_X86_SIMD
+    supported[BENCH_AVX2] = __builtin_cpu_supports("avx2");
+    supported[BENCH_SSE2] = __builtin_cpu_supports("sse2");
+#endif
+
+    printf("bench-scan: %zu bytes, best of %d runs\n", size, BENCH_RUNS);
+    int64_t expected = -1;
+    int scanner;
+    for (scanner = BENCH_AVX2; scanner <= BENCH_GETLINE; scanner++) {
+        if (!supported[scanner]) {
+            printf("bench-scan: %-8s not supported by this CPU\n", names[scanner]);
+            continue;
+        }
+        double best = 0;
+        int run;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            double start = benchNow();
+            int64_t lines = benchScan(scanner, path, buffer, size);
+            double elapsed = benchNow() - start;
+            if (run == 0 || elapsed < best) best = elapsed;
+
+            if (expected == -1) expected = lines;
+            if (lines != expected) {
+                fail("%s found %" PRId64 " lines, not %" PRId64, names[scanner], lines, expected);
+            }
+        }
+        printf("bench-scan: %-8s %8.3f s %9.1f MB/s %12" PRId64 " lines\n", names[scanner], best,
+               size / best / (1024 * 1024), expected);
+    }
+
+    free(buffer);
+    unlink(path);
+    printf("bench-scan: passed\n");
+    return 0;
+}
@@ -0,0 +1,264 @@
+/************ INCLUDES ************/
+
+// A check that simpad copes with a file over 4 GB: it runs ./simpad on a terminal of its own, and checks the line
+// count, a search for text past 4 GB, a jump to a byte offset past 4 GB and the size of the file saved after typing
+// there, both when the save writes just the tail in place and when it writes the whole file anew. Run it with
+// make check-large
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/************ DEFINES ************/
+
+#define LINE_LENGTH 4096 // Bytes in each line, newline included (long lines keep the number of rows, and memory, down)
+#define LINE_COUNT 1100000 // Lines in the file: 4,505,600,000 bytes, which is past 4 GiB
+#define FILE_SIZE ((uint64_t)LINE_LENGTH * LINE_COUNT)
+#define SCREEN_COLUMNS 160
+#define TIMEOUT 300 // Seconds to wait for anything simpad is asked to do
+#define MARKER "simpad-past-4g" // Text found only once in the file, in a line past 4 GiB, to search for
+#define MARKER_OFFSET (((uint64_t)1 << 32) + 5000 * LINE_LENGTH + 100) // Where it is (well clear of the edits)
+
+/************ TERMINAL ************/
+
+// simpad running on the far side of a pseudo terminal, and everything it has drawn so far
+struct session {
+    pid_t pid;
+    int fd;
+    char *output;
+    size_t length;
+    size_t capacity;
+};
+
+void fail(const char *format, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+void fail(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    fprintf(stderr, "check-large: FAIL: ");
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+void sessionStart(struct session *session, const char *simpad, const char *path, const char *durability) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) fail("posix_openpt: %s", strerror(errno));
+    char *slaveName = ptsname(master);
+    if (slaveName == NULL) fail("ptsname: %s", strerror(errno));
+
+    session->pid = fork();
+    if (session->pid == -1) fail("fork: %s", strerror(errno));
+    if (session->pid == 0) {
+        // The terminal becomes the child's controlling terminal, and its stdin and stdout
+        setsid();
+        int slave = open(slaveName, O_RDWR);
+        if (slave == -1) _exit(127);
+        struct winsize size = {24, SCREEN_COLUMNS, 0, 0};
+        ioctl(slave, TIOCSWINSZ, &size);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(slave);
+        close(master);
+        setenv("SIMPAD_WINDOW", "off", 1); // Lay out every line, so the line count and offsets are the real thing
+        setenv("SIMPAD_DURABILITY", durability, 1);
+        execl(simpad, simpad, path, (char *)NULL);
+        _exit(127);
+    }
+    session->fd = master;
+    session->output = NULL;
+    session->length = 0;
+    session->capacity = 0;
+}
+
+// Read what simpad draws until it has drawn text, or it has been too long
+void sessionWait(struct session *session, const char *text) {
+    time_t start = time(NULL);
+    size_t searched = 0;
+    while (1) {
+        if (session->length > searched) {
+            // Keep the screen as one string, with the NULs a terminal ignores taken out, to search for the text
+            session->output[session->length] = '\0';
+            if (strstr(&session->output[searched > 256 ? searched - 256 : 0], text)) return;
+            searched = session->length;
+        }
+        if (time(NULL) - start > TIMEOUT) fail("gave up waiting for \"%s\"", text);
+
+        struct pollfd pollFd = {session->fd, POLLIN, 0};
+        if (poll(&pollFd, 1, 1000) <= 0) continue;
+        if (session->capacity - session->length < 65537) {
+            session->capacity = session->capacity ? session->capacity * 2 : 1 << 20;
+            session->output = realloc(session->output, session->capacity);
+            if (session->output == NULL) fail("realloc");
+        }
+        ssize_t bytesRead = read(session->fd, &session->output[session->length], 65536);
+        if (bytesRead <= 0) fail("simpad went away waiting for \"%s\"", text);
+        size_t i;
+        for (i = 0; i < (size_t)bytesRead; i++) {
+            char c = session->output[session->length + i];
+            session->output[session->length + i] = c ? c : ' ';
+        }
+        session->length += bytesRead;
+    }
+}
+
+void sessionType(struct session *session, const char *keys) {
+    size_t length = strlen(keys);
+    if (write(session->fd, keys, length) != (ssize_t)length) fail("write: %s", strerror(errno));
+}
+
+// Quit simpad (the buffer has just been saved, or was never changed) and wait for it to exit
+void sessionQuit(struct session *session) {
+    sessionType(session, "\x11");
+    int status;
+    time_t start = time(NULL);
+    while (waitpid(session->pid, &status, WNOHANG) == 0) {
+        if (time(NULL) - start > TIMEOUT) {
+            kill(session->pid, SIGKILL);
+            fail("simpad did not quit");
+        }
+        char drain[4096];
+        struct pollfd pollFd = {session->fd, POLLIN, 0};
+        if (poll(&pollFd, 1, 100) > 0 && read(session->fd, drain, sizeof(drain)) <= 0) usleep(100000);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fail("simpad exited with status %d", status);
+    close(session->fd);
+    free(session->output);
+}
+
+/************ CHECKS ************/
+
+// Write the test file, all 'a's apart from the newlines and the marker, unless one that is already there is it (it
+// takes a while, and is left for the next run if a check fails). A journal left next to it by a run that failed
+// would only be asked about, so it goes
+void makeFile(const char *path) {
+    const char *slash = strrchr(path, '/');
+    int directory = slash ? (int)(slash - path) + 1 : 0;
+    char journal[4096];
+    snprintf(journal, sizeof(journal), "%.*s.%s.simpad-journal", directory, path, path + directory);
+    unlink(journal);
+
+    struct stat fileStat;
+    char line[LINE_LENGTH];
+    memset(line, 'a', LINE_LENGTH - 1);
+    line[LINE_LENGTH - 1] = '\n';
+    if (stat(path, &fileStat) == 0 && (uint64_t)fileStat.st_size == FILE_SIZE) {
+        int fd = open(path, O_RDONLY);
+        char last[LINE_LENGTH], marker[sizeof(MARKER) - 1];
+        int same = fd != -1 && pread(fd, last, LINE_LENGTH, FILE_SIZE - LINE_LENGTH) == LINE_LENGTH &&
+                   memcmp(last, line, LINE_LENGTH) == 0 &&
+                   pread(fd, marker, sizeof(marker), MARKER_OFFSET) == sizeof(marker) &&
+                   memcmp(marker, MARKER, sizeof(marker)) == 0;
+        if (fd != -1) close(fd);
+        if (same) return;
+    }
+
+    printf("check-large: writing %" PRIu64 " bytes to %s\n", FILE_SIZE, path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) fail("%s: %s", path, strerror(errno));
+    size_t blockLines = 256;
+    char *block = malloc(blockLines * LINE_LENGTH);
+    if (block == NULL) fail("malloc");
+    size_t i;
+    for (i = 0; i < blockLines; i++) memcpy(&block[i * LINE_LENGTH], line, LINE_LENGTH);
+    uint64_t written;
+    for (written = 0; written < LINE_COUNT; written += blockLines) {
+        size_t length = (LINE_COUNT - written < blockLines ? LINE_COUNT - written : blockLines) * LINE_LENGTH;
+        if (write(fd, block, length) != (ssize_t)length) fail("write: %s", strerror(errno));
+    }
+    free(block);
+    if (pwrite(fd, MARKER, strlen(MARKER), MARKER_OFFSET) != (ssize_t)strlen(MARKER)) fail("write: %s", strerror(errno));
+    close(fd);
+}
+
+// Open the file, wait for every line to be laid out and search for the marker. The cursor has to land on it, at
+// the right byte and line
+void checkFind(const char *simpad, const char *path) {
+    struct session session;
+    char text[128];
+    sessionStart(&session, simpad, path, "none");
+
+    // The line count only reaches the full count once the loader is done, and the search looks at the rows there are
+    snprintf(text, sizeof(text), "| byte 0 | 1/%d", LINE_COUNT);
+    sessionWait(&session, text);
+    sessionType(&session, "\x06" MARKER "\r");
+    snprintf(text, sizeof(text), "byte %" PRIu64 " | %" PRIu64 "/%d", MARKER_OFFSET, MARKER_OFFSET / LINE_LENGTH + 1, LINE_COUNT);
+    sessionWait(&session, text);
+    sessionQuit(&session);
+    printf("check-large: ok: found \"%s\" at byte %" PRIu64 "\n", MARKER, MARKER_OFFSET);
+}
+
+// Open the file, jump to offset and type c there, save and quit. Then the file has to be one byte longer, with c
+// at offset and the line it went into otherwise as it was
+void checkEdit(const char *simpad, const char *path, const char *durability, uint64_t offset, char c, uint64_t size) {
+    struct session session;
+    char text[128];
+    sessionStart(&session, simpad, path, durability);
+
+    // Jumping loads the rest of the file first, so by the time the cursor is there every line has to be counted
+    sessionWait(&session, "HELP");
+    snprintf(text, sizeof(text), "\x07%" PRIu64 "\r", offset);
+    sessionType(&session, text);
+    snprintf(text, sizeof(text), "byte %" PRIu64 " | %" PRIu64 "/%d", offset, offset / LINE_LENGTH + 1, LINE_COUNT);
+    sessionWait(&session, text);
+
+    snprintf(text, sizeof(text), "%c\x13", c);
+    sessionType(&session, text);
+    snprintf(text, sizeof(text), "bytes written to disk");
+    sessionWait(&session, text);
+    sessionQuit(&session);
+
+    struct stat fileStat;
+    if (stat(path, &fileStat) == -1) fail("%s: %s", path, strerror(errno));
+    if ((uint64_t)fileStat.st_size != size + 1) {
+        fail("saved %s (durability %s) is %" PRIu64 " bytes, not %" PRIu64, path, durability, (uint64_t)fileStat.st_size, size + 1);
+    }
+    int fd = open(path, O_RDONLY);
+    char around[3];
+    if (fd == -1 || pread(fd, around, 3, offset - 1) != 3) fail("%s: %s", path, strerror(errno));
+    close(fd);
+    if (around[0] != 'a' || around[1] != c || around[2] != 'a') {
+        fail("saved %s (durability %s) has \"%.3s\" at byte %" PRIu64, path, durability, around, offset - 1);
+    }
+    printf("check-large: ok: %d lines, jumped to byte %" PRIu64 ", saved %" PRIu64 " bytes (durability %s)\n",
+           LINE_COUNT, offset, size + 1, durability);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <simpad> <file to write>\n", argv[0]);
+        return 2;
+    }
+    const char *simpad = argv[1], *path = argv[2];
+    makeFile(path);
+    checkFind(simpad, path);
+
+    // Past 4 GiB, and not at the start of a line. With no syncing the save writes just the tail in place; with
+    // syncing it writes a new file beside the old one and renames it over
+    uint64_t offset = ((uint64_t)1 << 32) + 1000 * LINE_LENGTH + 7;
+    checkEdit(simpad, path, "none", offset, 'X', FILE_SIZE);
+    checkEdit(simpad, path, "data", offset + 2 * LINE_LENGTH, 'Y', FILE_SIZE + 1); // Two lines on, where the X is not
+
+    unlink(path);
+    printf("check-large: passed\n");
+    return 0;
+}